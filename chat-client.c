@@ -2,30 +2,397 @@
 // Simple chat client that connects to server and reads user input
 // Compile: gcc -Wall -O2 -o client client.c
 // Run: ./client <host> [port]
+//      ./client -b [-c conns] [-s senders] [-r rate] [-w window] [-l bytes]
+//               [-d secs] [-W warmup_secs] [-R room] [-j] <host> [port]
 // Default port: 12345
+//
+// -b turns the client into a load generator. It opens conns connections from
+// one epoll loop; the first senders of them send timestamped lines of the
+// given size and every connection measures how long each line took to reach
+// it. With -r each sender sends rate lines per second on a fixed schedule and
+// latency is taken from the scheduled send time, so a stalled server shows up
+// as latency instead of as fewer samples. Without -r the load is closed-loop:
+// each sender keeps window lines in flight, and a line counts as done when
+// the next connection has received it. -R runs the test in a room rather
+// than the lobby. Results cover the -d seconds after a -W second warmup and
+// are printed as text, or as JSON with -j.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/select.h>
+#include "hdr-hist.h"
 
 #define DEFAULT_PORT "12345"
 #define BUF_SZ 4096
+#define BENCH_RECV 65536
+#define BENCH_TAIL 8192            // longer than any line the server sends
+#define BENCH_MIN_LINE 48           // room for the header fields
+#define BENCH_DRAIN_NS 1000000000ull
+#define BENCH_SETUP_NS 30000000000ull
+
+// One load-generator connection.
+struct bconn {
+    int fd;
+    int ready;              // welcome (and room join) seen
+    char *out;              // bytes not yet accepted by the socket
+    size_t outlen, outcap;
+    char *in;               // unterminated tail of the last read
+    size_t inlen;
+    // sender side
+    uint64_t seq;
+    uint64_t next_ns;       // scheduled time of the next line with -r
+};
+
+struct bench {
+    int nconns, nsenders, window, json;
+    double rate;
+    size_t linelen;
+    double duration, warmup;
+    const char *room;
+
+    struct bconn *conns;
+    int epfd;
+    long runid;             // tags our lines so replayed history is ignored
+    uint64_t t_start, t_end;    // measurement window
+    int sending;
+
+    uint64_t sent, received, rbytes, errors;
+    struct hdr_hist lat;
+};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int connect_addr(struct addrinfo *res) {
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        int sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sockfd == -1) continue;
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            continue;
+        }
+        return sockfd;
+    }
+    return -1;
+}
+
+// Push out as much of the connection's pending output as the socket takes.
+int bconn_flush(struct bconn *bc) {
+    size_t off = 0;
+    while (off < bc->outlen) {
+        ssize_t n = send(bc->fd, bc->out + off, bc->outlen - off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        off += n;
+    }
+    memmove(bc->out, bc->out + off, bc->outlen - off);
+    bc->outlen -= off;
+    return 0;
+}
+
+int bconn_write(struct bconn *bc, const char *data, size_t len) {
+    if (bc->outlen + len > bc->outcap) {
+        size_t cap = bc->outcap ? bc->outcap : BUF_SZ;
+        while (cap < bc->outlen + len) cap *= 2;
+        char *grown = realloc(bc->out, cap);
+        if (grown == NULL) return -1;
+        bc->out = grown;
+        bc->outcap = cap;
+    }
+    memcpy(bc->out + bc->outlen, data, len);
+    bc->outlen += len;
+    // only try the socket when nothing was already waiting for EPOLLOUT
+    return bc->outlen == len ? bconn_flush(bc) : 0;
+}
+
+// Send sender i's next line, stamped with t.
+int bench_send(struct bench *b, int i, uint64_t t) {
+    struct bconn *bc = &b->conns[i];
+    char line[BUF_SZ];
+    int n = snprintf(line, sizeof line, "B %ld %d %llu %llu ", b->runid, i,
+                     (unsigned long long)bc->seq, (unsigned long long)t);
+    if ((size_t)n < b->linelen) {
+        memset(line + n, 'x', b->linelen - 1 - n);
+        n = b->linelen - 1;
+    }
+    line[n++] = '\n';
+    bc->seq++;
+    if (t >= b->t_start) b->sent++;
+    return bconn_write(bc, line, n);
+}
+
+// One line received on connection ci.
+void bench_line(struct bench *b, int ci, const char *line, size_t len, uint64_t now) {
+    struct bconn *bc = &b->conns[ci];
+    if (!bc->ready) {
+        if (b->room == NULL ? len >= 8 && memcmp(line, "Welcome!", 8) == 0
+                            : len >= 14 && memcmp(line, "Now talking in", 14) == 0) {
+            bc->ready = 1;
+        } else if (len >= 8 && memcmp(line, "Welcome!", 8) == 0) {
+            char cmd[128];
+            int n = snprintf(cmd, sizeof cmd, "/join %s\n", b->room);
+            if (bconn_write(bc, cmd, n) == -1) b->errors++;
+        }
+        return;
+    }
+
+    // "[room] Client N: B runid sender seq t ..."
+    const char *p = memmem(line, len, ": B ", 4);
+    if (p == NULL) return;
+    char *end;
+    long runid = strtol(p + 4, &end, 10);
+    if (runid != b->runid) return;
+    int sender = strtol(end, &end, 10);
+    strtoull(end, &end, 10);
+    uint64_t t = strtoull(end, &end, 10);
+    if (sender < 0 || sender >= b->nsenders) return;
+
+    if (t >= b->t_start && t < b->t_end) {
+        b->received++;
+        b->rbytes += len + 1;
+        hdr_record(&b->lat, now > t ? now - t : 0);
+    }
+    // closed loop: the connection after the sender acknowledges its lines
+    if (b->rate == 0 && b->sending && ci == (sender + 1) % b->nconns) {
+        if (bench_send(b, sender, now) == -1) b->errors++;
+    }
+}
+
+// Drain a connection's socket and hand every complete line to bench_line.
+int bench_read(struct bench *b, int ci, char *buf) {
+    struct bconn *bc = &b->conns[ci];
+    while (1) {
+        memcpy(buf, bc->in, bc->inlen);
+        ssize_t n = recv(bc->fd, buf + bc->inlen, BENCH_RECV, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        uint64_t now = now_ns();
+        size_t len = bc->inlen + n;
+        char *p = buf;
+        char *nl;
+        while ((nl = memchr(p, '\n', buf + len - p)) != NULL) {
+            bench_line(b, ci, p, nl - p, now);
+            p = nl + 1;
+        }
+        // keep the tail; one longer than any server line is garbage
+        bc->inlen = buf + len - p;
+        if (bc->inlen > BENCH_TAIL) bc->inlen = 0;
+        memcpy(bc->in, p, bc->inlen);
+    }
+}
+
+// Wait for events until deadline, then send whatever -r has scheduled.
+int bench_poll(struct bench *b, uint64_t deadline, char *buf) {
+    struct epoll_event events[256];
+    uint64_t now = now_ns();
+    int timeout = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+    int n = epoll_wait(b->epfd, events, 256, timeout);
+    if (n == -1 && errno != EINTR) {
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < n; ++i) {
+        int ci = events[i].data.u32;
+        struct bconn *bc = &b->conns[ci];
+        if (events[i].events & EPOLLOUT && bconn_flush(bc) == -1) {
+            fprintf(stderr, "Connection %d: send failed\n", ci);
+            return -1;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) && bench_read(b, ci, buf) == -1) {
+            fprintf(stderr, "Connection %d: closed by server\n", ci);
+            return -1;
+        }
+    }
+    if (b->sending && b->rate > 0) {
+        now = now_ns();
+        uint64_t interval = (uint64_t)(1e9 / b->rate);
+        for (int i = 0; i < b->nsenders; ++i) {
+            struct bconn *bc = &b->conns[i];
+            while (bc->next_ns <= now) {
+                if (bench_send(b, i, bc->next_ns) == -1) return -1;
+                bc->next_ns += interval;
+            }
+        }
+    }
+    return 0;
+}
+
+void bench_report(struct bench *b) {
+    double secs = b->duration;
+    if (b->json) {
+        printf("{\"connections\": %d, \"senders\": %d, \"rate\": %g, \"window\": %d, \"line_bytes\": %zu, "
+               "\"room\": \"%s\", \"duration_s\": %g, \"warmup_s\": %g, \"sent\": %llu, \"received\": %llu, "
+               "\"sent_per_s\": %.1f, \"received_per_s\": %.1f, \"received_bytes_per_s\": %.1f, \"latency_us\": ",
+               b->nconns, b->nsenders, b->rate, b->window, b->linelen, b->room ? b->room : "lobby",
+               secs, b->warmup, (unsigned long long)b->sent, (unsigned long long)b->received,
+               b->sent / secs, b->received / secs, b->rbytes / secs);
+        hdr_print_json(&b->lat, stdout, 1000.0);
+        printf("}\n");
+        return;
+    }
+    printf("%d connections, %d senders, %zu byte lines, ", b->nconns, b->nsenders, b->linelen);
+    if (b->rate > 0) printf("%g lines/s per sender", b->rate);
+    else printf("closed loop, window %d", b->window);
+    printf(", %g s after %g s warmup\n", secs, b->warmup);
+    printf("sent      %12llu lines  %12.1f lines/s\n", (unsigned long long)b->sent, b->sent / secs);
+    printf("received  %12llu lines  %12.1f lines/s  %8.2f MB/s\n", (unsigned long long)b->received,
+           b->received / secs, b->rbytes / secs / 1e6);
+    printf("end-to-end latency:\n");
+    hdr_print(&b->lat, stdout, 1000.0, "us");
+}
+
+int bench_run(struct bench *b, struct addrinfo *res) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    b->epfd = epoll_create1(0);
+    b->conns = calloc(b->nconns, sizeof *b->conns);
+    char *buf = malloc(BENCH_TAIL + BENCH_RECV);
+    if (b->epfd == -1 || b->conns == NULL || buf == NULL) {
+        perror("bench setup");
+        return -1;
+    }
+    hdr_init(&b->lat);
+    b->runid = getpid();
+    b->t_start = b->t_end = UINT64_MAX;
+
+    for (int i = 0; i < b->nconns; ++i) {
+        struct bconn *bc = &b->conns[i];
+        bc->fd = connect_addr(res);
+        if (bc->fd == -1 || (bc->in = malloc(BENCH_TAIL)) == NULL) {
+            fprintf(stderr, "Connection %d failed: %s\n", i, strerror(errno));
+            return -1;
+        }
+        int one = 1;
+        setsockopt(bc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        fcntl(bc->fd, F_SETFL, fcntl(bc->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u32 = i };
+        if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, bc->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    // every connection must be greeted (and in the room) before the clock starts
+    uint64_t deadline = now_ns() + BENCH_SETUP_NS;
+    int ready = 0;
+    while (ready < b->nconns) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "Only %d of %d connections ready, giving up\n", ready, b->nconns);
+            return -1;
+        }
+        if (bench_poll(b, now_ns() + 100000000, buf) == -1) return -1;
+        ready = 0;
+        for (int i = 0; i < b->nconns; ++i) ready += b->conns[i].ready;
+    }
+    fprintf(stderr, "%d connections ready\n", b->nconns);
+
+    uint64_t t0 = now_ns();
+    b->t_start = t0 + (uint64_t)(b->warmup * 1e9);
+    b->t_end = b->t_start + (uint64_t)(b->duration * 1e9);
+    b->sending = 1;
+    for (int i = 0; i < b->nsenders; ++i) {
+        struct bconn *bc = &b->conns[i];
+        if (b->rate > 0) {
+            // spread the senders over one interval instead of all firing at once
+            bc->next_ns = t0 + (uint64_t)(1e9 / b->rate) * i / b->nsenders;
+        } else {
+            for (int w = 0; w < b->window; ++w) {
+                if (bench_send(b, i, t0) == -1) return -1;
+            }
+        }
+    }
+    while (now_ns() < b->t_end) {
+        uint64_t next = b->t_end;
+        for (int i = 0; b->rate > 0 && i < b->nsenders; ++i) {
+            if (b->conns[i].next_ns < next) next = b->conns[i].next_ns;
+        }
+        if (bench_poll(b, next, buf) == -1) return -1;
+    }
+    // stop sending and give lines still in flight a moment to arrive
+    b->sending = 0;
+    uint64_t drain = now_ns() + BENCH_DRAIN_NS;
+    while (now_ns() < drain) {
+        if (bench_poll(b, drain, buf) == -1) return -1;
+    }
+    if (b->errors > 0) fprintf(stderr, "%llu send errors\n", (unsigned long long)b->errors);
+
+    bench_report(b);
+    for (int i = 0; i < b->nconns; ++i) {
+        close(b->conns[i].fd);
+        free(b->conns[i].out);
+        free(b->conns[i].in);
+    }
+    free(b->conns);
+    free(buf);
+    close(b->epfd);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <host> [port]\n"
+                    "       %s -b [-c conns] [-s senders] [-r rate] [-w window] [-l bytes] [-d secs]\n"
+                    "          [-W warmup_secs] [-R room] [-j] <host> [port]\n", prog, prog);
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <host> [port]\n", argv[0]);
-        exit(EXIT_FAILURE);
+    struct bench b = {
+        .nconns = 100, .nsenders = 10, .window = 1, .linelen = 64,
+        .duration = 10, .warmup = 2,
+    };
+    int bench = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "bc:s:r:w:l:d:W:R:jh")) != -1) {
+        switch (opt) {
+        case 'b': bench = 1; break;
+        case 'c': b.nconns = atoi(optarg); break;
+        case 's': b.nsenders = atoi(optarg); break;
+        case 'r': b.rate = atof(optarg); break;
+        case 'w': b.window = atoi(optarg); break;
+        case 'l': b.linelen = strtoul(optarg, NULL, 10); break;
+        case 'd': b.duration = atof(optarg); break;
+        case 'W': b.warmup = atof(optarg); break;
+        case 'R': b.room = optarg; break;
+        case 'j': b.json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+    if (b.nconns < 2 || b.nsenders < 1 || b.nsenders > b.nconns || b.window < 1 || b.rate < 0 ||
+        b.duration <= 0 || b.warmup < 0 || b.linelen < BENCH_MIN_LINE || b.linelen > BUF_SZ) {
+        usage(argv[0]);
     }
-    const char *host = argv[1];
-    const char *port = (argc > 2) ? argv[2] : DEFAULT_PORT;
+    const char *host = argv[optind];
+    const char *port = (optind + 1 < argc) ? argv[optind + 1] : DEFAULT_PORT;
 
-    struct addrinfo hints, *res, *p;
+    struct addrinfo hints, *res;
     int sockfd = -1;
     int rv;
 
@@ -38,17 +405,13 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    for (p = res; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1) continue;
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            sockfd = -1;
-            continue;
-        }
-        break;
+    if (bench) {
+        rv = bench_run(&b, res);
+        freeaddrinfo(res);
+        return rv == -1 ? 3 : 0;
     }
 
+    sockfd = connect_addr(res);
     freeaddrinfo(res);
 
     if (sockfd == -1) {
@@ -57,6 +420,7 @@ int main(int argc, char *argv[]) {
     }
 
     printf("Connected to %s:%s. Type messages and press Enter to send. Ctrl+C to quit.\n", host, port);
+    printf("Commands: /join <room>, /leave [room], /msg <room> <text>, /rooms\n");
 
     fd_set read_fds;
     int fd_stdin = fileno(stdin);
@@ -1,28 +1,420 @@
 // server.c
-// Simple multi-client chat server using select()
-// Compile: gcc -Wall -O2 -o server server.c
-// Run: ./server [port]
+// Multi-client chat server using an edge-triggered epoll event loop
+// Compile: gcc -Wall -O2 -pthread -o server server.c
+// Run: ./server [--threads N] [-E epoll|io_uring] [-q high_water_bytes] [-P drop|disconnect] [-z zerocopy_bytes]
+//               [-H history_lines] [-L history_log] [-l log_lines_per_sec] [-S stats_secs]
+//               [-A admin_socket] [port]
 // Default port: 12345
+//
+// Each client has an outbound queue that is drained when its socket is
+// writable, so a slow reader never blocks the loop. Once a client has more
+// than high_water_bytes queued (default 1 MiB) the slow-consumer policy
+// applies: "drop" discards its oldest unsent messages, "disconnect" closes it.
+//
+// A broadcast is formatted once into a reference-counted buffer that every
+// recipient queue points at. Queues are flushed once per event batch with a
+// single sendmsg() over all pending buffers; with -z, batches of at least
+// zerocopy_bytes are sent with MSG_ZEROCOPY.
+//
+// Input is newline-delimited. Each client keeps the unterminated tail of its
+// last read until the rest of the line arrives. A line longer than MAX_LINE
+// is cut into MAX_LINE-byte lines plus the rest, the same way however the
+// reads break it up. All complete lines from one read go out as a single
+// broadcast.
+//
+// Messages are scoped to rooms. Every client starts in "lobby" and can be in
+// any number of rooms at once:
+//   /join <room>         join a room and make it the current one
+//   /leave [room]        leave a room (default: the current one)
+//   /msg <room> <text>   send to a room you are in without switching to it
+//   /rooms               list your rooms, the current one marked with '*'
+// Any other line goes to the current room. Each shard keeps a hash table of
+// rooms that have local members, and each room a dense member list, so a
+// message only visits that room's members; a room is freed with its last
+// member.
+//
+// Each room remembers its last history_lines lines (default 32, 0 turns it
+// off, at most 8 KiB) and a client joining it gets them as one write. With
+// -L the history is also appended to an mmapped log, so after a restart a
+// room's history is rebuilt from its last log records when it is next used.
+//
+// With --threads N the server runs N shards. Each shard is a thread with its
+// own SO_REUSEPORT listener, epoll loop and client table. A broadcast is
+// delivered locally and handed to every other shard through a lock-free
+// mailbox signalled with an eventfd; each mailbox is FIFO per producer, so a
+// sender's messages reach every client in the order they were sent.
+//
+// -E io_uring replaces each shard's epoll loop with an io_uring engine:
+// multishot accept, multishot recv into a ring of provided buffers, and one
+// sendmsg in flight per client carrying its whole queue. Completions are
+// reaped and the resulting sends submitted in one io_uring_enter() per loop
+// iteration. If the kernel lacks any of it the shard falls back to epoll.
+// MSG_ZEROCOPY (-z) only applies to the epoll engine.
+//
+// Every shard keeps its own counters and latency histograms (broadcast
+// fan-out time and event-loop iteration time). Only the shard writes them,
+// with relaxed atomic stores, so they cost no locked instructions. A monitor
+// thread reads them: -S prints a summary to stderr every stats_secs, and -A
+// serves a JSON snapshot to anyone connecting to the admin unix socket, e.g.
+// `socat - UNIX-CONNECT:admin_socket`. The chat echo on stdout goes through a
+// per-shard ring that the monitor thread drains; past log_lines_per_sec
+// (default 10000, 0 turns it off) or when the ring is full, lines are
+// dropped and counted instead of stalling the shard.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include "hdr-hist.h"
 
-#define BACKLOG 10
-#define BUF_SZ 4096
+#define BACKLOG 4096
+#define BUF_SZ 65536
+#define MAX_LINE 4096
 #define DEFAULT_PORT "12345"
-#define MAX_CLIENTS FD_SETSIZE
+#define MAX_EVENTS 256
+#define INITIAL_CLIENTS 64
+#define INITIAL_QUEUE 16
+#define DEFAULT_HIGH_WATER (1024 * 1024)
+#define IOV_BATCH 64
+#define MAX_THREADS 256
+#define UR_ENTRIES 4096
+#define UR_BUFS 256             // provided receive buffers per shard, power of two
+#define UR_BUF_SZ 16384
+#define UR_BGID 0
+#define UR_SETTLE_EVERY 32      // completions handled before queued sends are pushed out
+#define LOBBY "lobby"
+#define MAX_ROOM_NAME 64
+#define MAX_PREFIX (MAX_ROOM_NAME + 32)     // "[room] Client N: "
+#define INITIAL_ROOM_BUCKETS 64
+#define INITIAL_ROOM_MEMBERS 4
+#define DEFAULT_HISTORY 32
+#define HISTORY_MAX_LINES 128
+#define HISTORY_BYTES 8192      // per room, power of two
+#define HISTORY_SLAB 32         // rings allocated at a time
+#define HIST_STRIPES 64         // locks over the shared history table, power of two
+#define LOG_INITIAL (1 << 20)
+#define DEFAULT_LOG_RATE 10000
+#define LOG_RING (1 << 20)          // per shard, power of two
+#define MONITOR_TICK_MS 20
+
+// io_uring user_data: the low 3 bits say what completed. Socket operations
+// carry fd << 32 | generation << 3 so completions for a closed fd that has
+// since been reused are recognised; sends carry their send_op pointer.
+enum { UD_ACCEPT = 1, UD_RECV, UD_SEND, UD_MBOX };
+#define UD_TYPE_MASK 7
+#define UD_GEN_MASK 0x1fffffff
+
+enum slow_policy { POLICY_DROP_OLDEST, POLICY_DISCONNECT };
+
+static size_t high_water = DEFAULT_HIGH_WATER;
+static enum slow_policy slow_policy = POLICY_DROP_OLDEST;
+static size_t zerocopy_min = 0;     // 0 disables MSG_ZEROCOPY
+static int nthreads = 1;
+static int want_uring = 0;
+static int history_lines = DEFAULT_HISTORY;
+static int log_rate = DEFAULT_LOG_RATE;
+static int stats_interval = 0;      // seconds, 0 for no periodic dump
+static const char *admin_path = NULL;
+
+// Client ids are handed out by every shard, so the counter is shared.
+static int next_id = 1;
+
+// An outbound message shared by every queue it sits in, possibly across
+// shards; freed with the last reference. The name of the room it is
+// addressed to is stored right after the payload, so every shard can route it.
+struct msgbuf {
+    int refcnt;     // atomic
+    size_t len;
+    uint32_t room_hash;
+    int room_len;   // 0 for a message sent straight to one client
+    uint64_t seq;   // history serial, 0 if it was not recorded
+    char data[];
+};
+
+// A member's entry in a room, and a room's entry in a client. Each side
+// records the other's index so leaving is a swap-remove on both lists.
+struct room_member {
+    int slot;       // client slot on this shard
+    int cidx;       // position in that client's rooms[]
+    uint64_t since; // history serial from which messages are delivered live
+};
+
+struct client_room {
+    struct room *room;
+    int ridx;       // position in the room's members[]
+};
+
+// A room with at least one member on this shard, chained in the shard's room table.
+struct room {
+    struct room *next;
+    uint32_t hash;
+    struct hist_room *hist;
+    struct room_member *members;
+    int nmembers, cap;
+    int name_len;
+    char name[];
+};
+
+// A buffer pinned by an in-flight MSG_ZEROCOPY send, released by its completion.
+struct zcref {
+    uint32_t seq;
+    struct msgbuf *m;
+};
+
+// One connected chat client, stored in a slot of clients[].
+struct client {
+    int fd;
+    int id;
+    int member;     // position in members[], -1 while the slot is free
+    int closing;    // set once the client is scheduled to be dropped
+
+    int dirty;      // on the flush list for this event batch
+
+    // reassembly buffer for a line that has not seen its '\n' yet
+    char *rbuf;     // MAX_LINE bytes, allocated on first use
+    size_t rlen;
+
+    // outbound ring of pending messages; capacity is a power of two
+    struct msgbuf **q;
+    int qhead, qlen, qcap;
+    size_t qoff;    // bytes of the head message already sent
+    size_t qbytes;  // unsent bytes across the whole queue
+
+    // MSG_ZEROCOPY state: sends issued so far and buffers awaiting completion
+    int zerocopy;
+    uint32_t zc_seq;
+    struct zcref *zc;
+    int zchead, zclen, zccap;
+
+    // io_uring engine: generation tag and the send currently in flight
+    uint32_t gen;
+    int sending;
+    int qpinned;    // head messages referenced by the in-flight send
+
+    // rooms this client is in; plain lines go to cur
+    struct client_room *rooms;
+    int nrooms, roomcap;
+    struct room *cur;
+};
+
+// A cross-shard delivery. Intrusive node of a Vyukov MPSC queue.
+struct mbox_node {
+    struct mbox_node *next;     // atomic
+    struct msgbuf *m;
+};
+
+// Multi-producer, single-consumer mailbox owned by one shard. Producers push
+// with a single atomic exchange and write the eventfd only when the consumer
+// has not been signalled yet, so a busy shard costs one wakeup per drain.
+struct mailbox {
+    struct mbox_node *head;     // atomic, last pushed node
+    struct mbox_node *tail;     // consumer side
+    struct mbox_node stub;
+    int signalled;              // atomic
+    int evfd;
+};
+
+// An io_uring instance: the mmapped submission/completion rings and the
+// provided-buffer ring multishot recv picks its buffers from.
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_local;          // our tail, published on submit
+    unsigned pending;           // SQEs not yet consumed by the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // completions moved off the ring while the SQ was full, handled first
+    struct io_uring_cqe *stash;
+    unsigned stash_head, stash_len, stash_cap;
+    void *ring_mem;
+    size_t ring_sz;
+    size_t sqes_sz;
+
+    struct io_uring_buf_ring *br;
+    uint16_t br_tail;
+    char *bufs;
+};
+
+// One in-flight io_uring sendmsg. The msghdr and iovecs only need to live
+// until submission, but the buffers stay referenced until the completion.
+struct send_op {
+    struct send_op *next;       // free list
+    int fd;
+    uint32_t gen;
+    int nmsgs;
+    struct msghdr mh;
+    struct iovec iov[IOV_BATCH];
+    struct msgbuf *m[IOV_BATCH];
+};
+
+// Counters and histograms of one shard. Written only by the shard, read by
+// the monitor thread; see counter_add().
+struct metrics {
+    uint64_t accepted, closed;
+    uint64_t lines_in, bytes_in;    // read from clients
+    uint64_t msgs_out, bytes_out;   // queued for, and written to, clients
+    uint64_t dropped;               // messages discarded by the drop policy
+    uint64_t evicted;               // clients closed by the disconnect policy
+    uint64_t queued;                // bytes waiting in outbound queues
+    uint64_t queue_peak;            // largest single client queue seen
+    uint64_t loops;
+    struct hdr_hist fanout_ns;      // delivering one message to a room's local members
+    struct hdr_hist loop_ns;        // handling one batch of events
+};
+
+// Log output on its way to stdout. Single producer (the shard), single
+// consumer (the monitor thread); lines that do not fit the ring or the rate
+// budget are counted in dropped instead.
+struct logring {
+    char *buf;
+    uint64_t head;          // atomic, consumer position
+    uint64_t tail;          // atomic, producer position
+    uint64_t dropped;       // atomic
+    double tokens;          // producer only: lines that may still be logged
+    uint64_t refill_ns;
+};
+
+// Everything one event-loop thread owns. Only the owning thread touches a
+// shard, except for its mailbox, metrics and log ring.
+struct shard {
+    int index;
+    int epfd;
+    int listener;
+    pthread_t thread;
+    struct mailbox mbox;
+
+    // io_uring engine, NULL when the shard runs on epoll
+    struct uring *ur;
+    uint32_t next_gen;
+    struct send_op *free_ops;
+
+    // Slot storage; free slots are kept on a stack so allocation is O(1).
+    struct client *clients;
+    int nslots;
+    int *free_slots;
+    int nfree;
+
+    // fd -> slot index (-1 if the fd is not a client), grown to the highest fd seen.
+    int *fd_slot;
+    int fd_slot_cap;
+
+    // Dense list of live slots; broadcast only walks these.
+    int *members;
+    int nmembers;
+
+    // fds of clients waiting to be closed at the end of the current event batch.
+    int *closing_fds;
+    int nclosing;
+    int closing_cap;
+
+    // fds of clients with queued data, flushed once at the end of the event batch.
+    int *dirty_fds;
+    int ndirty;
+    int dirty_cap;
+
+    // Rooms with local members: chained hash table, nbuckets a power of two.
+    struct room **room_buckets;
+    int nbuckets;
+    int nrooms;
+
+    uint64_t now;           // start of the current event batch, ns
+    struct metrics stats;
+    struct logring log;
+};
+
+static struct shard *shards = NULL;
 
 int max(int a, int b){ return a>b? a:b; }
 
-int setup_listen(const char *port) {
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Bump a metric owned by the calling shard. Other threads only read it, so
+// a relaxed load and store is enough and avoids a locked add.
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void gauge_max(uint64_t *gauge, uint64_t v) {
+    if (v > *gauge) __atomic_store_n(gauge, v, __ATOMIC_RELAXED);
+}
+
+int count_lines(const char *data, size_t len) {
+    int n = 0;
+    for (const char *p = data; (p = memchr(p, '\n', data + len - p)) != NULL; ++p) n++;
+    return n;
+}
+
+// Queue lines for the monitor thread to print. Never blocks: over the rate
+// budget or with the ring full the lines are only counted.
+void log_write(struct shard *sh, const char *data, size_t len) {
+    struct logring *lr = &sh->log;
+    if (log_rate == 0 || lr->buf == NULL) return;
+    int lines = count_lines(data, len);
+    if (lines == 0) lines = 1;
+    // token bucket refilled at log_rate lines per second, one second of burst
+    lr->tokens += (double)(sh->now - lr->refill_ns) * log_rate / 1e9;
+    if (lr->tokens > log_rate) lr->tokens = log_rate;
+    lr->refill_ns = sh->now;
+    uint64_t tail = lr->tail;
+    if (lr->tokens < lines || len > LOG_RING - (tail - __atomic_load_n(&lr->head, __ATOMIC_ACQUIRE))) {
+        counter_add(&lr->dropped, lines);
+        return;
+    }
+    lr->tokens -= lines;
+    size_t pos = tail & (LOG_RING - 1);
+    size_t n = len < LOG_RING - pos ? len : LOG_RING - pos;
+    memcpy(lr->buf + pos, data, n);
+    memcpy(lr->buf, data + n, len - n);
+    __atomic_store_n(&lr->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Raise the soft descriptor limit to the hard limit so the server can hold
+// more connections than the (usually 1024) default allows.
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) perror("setrlimit");
+    }
+}
+
+int setup_listen(const char *port, int reuseport) {
     struct addrinfo hints, *res, *p;
     int listenfd = -1;
     int yes = 1;
@@ -39,10 +431,17 @@ int setup_listen(const char *port) {
     }
 
     for(p = res; p != NULL; p = p->ai_next) {
-        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
         if (listenfd == -1) continue;
 
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        // every shard binds its own listener; the kernel spreads connections
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("SO_REUSEPORT");
+            close(listenfd);
+            freeaddrinfo(res);
+            return -1;
+        }
 
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(listenfd);
@@ -69,149 +468,2184 @@ int setup_listen(const char *port) {
     return listenfd;
 }
 
-void broadcast(int sender_fd, int *clients, int max_clients, const char *msg, ssize_t msglen) {
-    for (int i = 0; i < max_clients; ++i) {
-        int fd = clients[i];
-        if (fd != -1 && fd != sender_fd) {
-            ssize_t sent = 0;
-            while (sent < msglen) {
-                ssize_t n = send(fd, msg + sent, msglen - sent, 0);
-                if (n <= 0) {
-                    // can't handle here; client will be cleaned up on recv error
-                    break;
+// FNV-1a; room names are short, so this is cheap enough to do per message.
+uint32_t room_hash(const char *name, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Allocate a message of len bytes. There is always space for a room name
+// after the payload; msg_set_room() fills it in once the payload is final.
+struct msgbuf *msg_new(size_t len) {
+    struct msgbuf *m = malloc(sizeof *m + len + MAX_ROOM_NAME);
+    if (m == NULL) return NULL;
+    m->refcnt = 1;
+    m->len = len;
+    m->room_hash = 0;
+    m->room_len = 0;
+    m->seq = 0;
+    return m;
+}
+
+void msg_set_room(struct msgbuf *m, const char *name, int len, uint32_t hash) {
+    memcpy(m->data + m->len, name, len);
+    m->room_len = len;
+    m->room_hash = hash;
+}
+
+void msg_ref(struct msgbuf *m) {
+    __atomic_fetch_add(&m->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void msg_unref(struct msgbuf *m) {
+    if (__atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL) == 0) free(m);
+}
+
+// Room history. The last history_lines lines of every room live in a fixed
+// byte ring plus a ring of line start offsets. All rings are the same size
+// and are carved out of a slab, so a busy room never mallocs per message.
+// History is shared by all shards: one entry per room name, in a hash table
+// split into lock stripes, alive while some shard has the room.
+struct history {
+    struct history *next_free;
+    uint32_t tail;          // bytes ever written, wrapping
+    int first, count;       // oldest entry in start[] and lines held
+    uint32_t start[HISTORY_MAX_LINES];
+    char bytes[HISTORY_BYTES];
+};
+
+struct hist_room {
+    struct hist_room *next;
+    uint32_t hash;
+    int nshards;            // shards on which the room has members
+    struct history *h;      // allocated with the first line
+    uint64_t log_last;      // offset + 1 of the room's newest log record, 0 if none
+    int name_len;
+    char name[];
+};
+
+struct hist_stripe {
+    pthread_mutex_t lock;
+    struct hist_room **buckets;
+    int nbuckets, n;
+};
+
+// Optional append-only history log (-L), mmapped and grown by doubling.
+// Records are chained per room so a room's history can be rebuilt by walking
+// back from its newest record.
+struct log_rec {
+    uint32_t len;           // payload bytes; 0 marks the end of the log
+    uint32_t room_len;
+    uint64_t prev;          // offset + 1 of the room's previous record, 0 if none
+    char data[];            // room name, then payload, padded to 8 bytes
+};
+
+struct hist_log {
+    pthread_mutex_t lock;
+    int fd;
+    char *map;
+    size_t len, cap;
+};
+
+static struct hist_stripe hist_stripes[HIST_STRIPES];
+static struct hist_log *hist_log = NULL;
+static pthread_mutex_t hist_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct history *hist_free = NULL;
+
+// Serial number of the last message that went into any history; orders
+// history against live delivery so a joiner never sees a line twice.
+static uint64_t hist_seq = 0;
+
+struct history *hist_alloc(void) {
+    pthread_mutex_lock(&hist_slab_lock);
+    if (hist_free == NULL) {
+        struct history *slab = malloc(HISTORY_SLAB * sizeof *slab);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&hist_slab_lock);
+            return NULL;
+        }
+        for (int i = 0; i < HISTORY_SLAB; ++i) {
+            slab[i].next_free = hist_free;
+            hist_free = &slab[i];
+        }
+    }
+    struct history *h = hist_free;
+    hist_free = h->next_free;
+    pthread_mutex_unlock(&hist_slab_lock);
+    h->tail = 0;
+    h->first = h->count = 0;
+    return h;
+}
+
+void hist_release(struct history *h) {
+    pthread_mutex_lock(&hist_slab_lock);
+    h->next_free = hist_free;
+    hist_free = h;
+    pthread_mutex_unlock(&hist_slab_lock);
+}
+
+// Append one line, '\n' included, evicting the oldest lines to make room.
+void hist_push_line(struct history *h, const char *line, uint32_t len) {
+    if (len > HISTORY_BYTES) return;
+    while (h->count > 0 && (h->count == history_lines || h->tail + len - h->start[h->first] > HISTORY_BYTES)) {
+        h->first = (h->first + 1) % HISTORY_MAX_LINES;
+        h->count--;
+    }
+    h->start[(h->first + h->count) % HISTORY_MAX_LINES] = h->tail;
+    h->count++;
+    uint32_t pos = h->tail & (HISTORY_BYTES - 1);
+    uint32_t n = len < HISTORY_BYTES - pos ? len : HISTORY_BYTES - pos;
+    memcpy(h->bytes + pos, line, n);
+    memcpy(h->bytes, line + n, len - n);
+    h->tail += len;
+}
+
+void hist_push(struct history *h, const char *data, size_t len) {
+    const char *end = data + len;
+    while (data < end) {
+        const char *nl = memchr(data, '\n', end - data);
+        const char *next = nl != NULL ? nl + 1 : end;
+        hist_push_line(h, data, next - data);
+        data = next;
+    }
+}
+
+struct hist_stripe *hist_stripe_of(uint32_t hash) {
+    return &hist_stripes[hash & (HIST_STRIPES - 1)];
+}
+
+// Find the history entry for a room, creating it if asked. Caller holds the stripe lock.
+struct hist_room *hist_lookup(struct hist_stripe *st, const char *name, int len, uint32_t hash, int create) {
+    if (st->nbuckets > 0) {
+        for (struct hist_room *e = st->buckets[(hash / HIST_STRIPES) & (st->nbuckets - 1)]; e != NULL; e = e->next) {
+            if (e->hash == hash && e->name_len == len && memcmp(e->name, name, len) == 0) return e;
+        }
+    }
+    if (!create) return NULL;
+    if (st->n >= st->nbuckets) {
+        int nbuckets = st->nbuckets ? st->nbuckets * 2 : INITIAL_ROOM_BUCKETS;
+        struct hist_room **buckets = calloc(nbuckets, sizeof *buckets);
+        if (buckets != NULL) {
+            for (int i = 0; i < st->nbuckets; ++i) {
+                struct hist_room *e = st->buckets[i];
+                while (e != NULL) {
+                    struct hist_room *next = e->next;
+                    struct hist_room **head = &buckets[(e->hash / HIST_STRIPES) & (nbuckets - 1)];
+                    e->next = *head;
+                    *head = e;
+                    e = next;
                 }
-                sent += n;
             }
+            free(st->buckets);
+            st->buckets = buckets;
+            st->nbuckets = nbuckets;
+        } else if (st->nbuckets == 0) {
+            return NULL;
         }
     }
+    struct hist_room *e = malloc(sizeof *e + len);
+    if (e == NULL) return NULL;
+    e->hash = hash;
+    e->nshards = 0;
+    e->h = NULL;
+    e->log_last = 0;
+    e->name_len = len;
+    memcpy(e->name, name, len);
+    struct hist_room **head = &st->buckets[(hash / HIST_STRIPES) & (st->nbuckets - 1)];
+    e->next = *head;
+    *head = e;
+    st->n++;
+    return e;
 }
 
-int main(int argc, char *argv[]) {
-    const char *port = (argc > 1) ? argv[1] : DEFAULT_PORT;
-    int listener = setup_listen(port);
-    if (listener < 0) exit(EXIT_FAILURE);
+void hist_unlink(struct hist_stripe *st, struct hist_room *e) {
+    struct hist_room **pp = &st->buckets[(e->hash / HIST_STRIPES) & (st->nbuckets - 1)];
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    st->n--;
+    free(e);
+}
+
+size_t log_rec_size(uint32_t room_len, uint32_t len) {
+    return (sizeof(struct log_rec) + room_len + len + 7) & ~(size_t)7;
+}
+
+// Append a room message to the log. Caller holds the room's stripe lock.
+void log_append(struct hist_room *e, const char *data, size_t len) {
+    struct hist_log *lg = hist_log;
+    pthread_mutex_lock(&lg->lock);
+    size_t need = log_rec_size(e->name_len, len);
+    // keep a zeroed header after the last record so a reader always finds the end
+    if (lg->len + need + sizeof(struct log_rec) > lg->cap) {
+        size_t cap = lg->cap * 2;
+        while (lg->len + need + sizeof(struct log_rec) > cap) cap *= 2;
+        char *map;
+        if (ftruncate(lg->fd, cap) == -1 ||
+            (map = mremap(lg->map, lg->cap, cap, MREMAP_MAYMOVE)) == MAP_FAILED) {
+            perror("Failed to grow history log");
+            pthread_mutex_unlock(&lg->lock);
+            return;
+        }
+        lg->map = map;
+        lg->cap = cap;
+    }
+    struct log_rec *rec = (struct log_rec *)(lg->map + lg->len);
+    rec->room_len = e->name_len;
+    rec->prev = e->log_last;
+    memcpy(rec->data, e->name, e->name_len);
+    memcpy(rec->data + e->name_len, data, len);
+    memset(lg->map + lg->len + need, 0, sizeof(struct log_rec));
+    // the length goes in last: a record is only valid once it is complete
+    __atomic_store_n(&rec->len, (uint32_t)len, __ATOMIC_RELEASE);
+    e->log_last = lg->len + 1;
+    lg->len += need;
+    pthread_mutex_unlock(&lg->lock);
+}
 
-    printf("Listening on port %s\n", port);
+// Rebuild a room's ring from its newest log records. Caller holds the stripe lock.
+void log_fill(struct hist_room *e) {
+    struct hist_log *lg = hist_log;
+    pthread_mutex_lock(&lg->lock);
+    // walk back until enough lines are covered, then replay oldest first
+    uint64_t offs[HISTORY_MAX_LINES];
+    int n = 0, lines = 0;
+    for (uint64_t off = e->log_last; off != 0 && n < HISTORY_MAX_LINES && lines < history_lines; ) {
+        struct log_rec *rec = (struct log_rec *)(lg->map + off - 1);
+        offs[n++] = off - 1;
+        lines += count_lines(rec->data + rec->room_len, rec->len);
+        off = rec->prev;
+    }
+    while (n > 0) {
+        struct log_rec *rec = (struct log_rec *)(lg->map + offs[--n]);
+        hist_push(e->h, rec->data + rec->room_len, rec->len);
+    }
+    pthread_mutex_unlock(&lg->lock);
+}
+
+// Map the history log at path and index the records already in it. Only
+// record headers are read; message text is left alone until a room is used.
+int log_open(const char *path) {
+    struct hist_log *lg = calloc(1, sizeof *lg);
+    if (lg == NULL) return -1;
+    pthread_mutex_init(&lg->lock, NULL);
+    lg->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lg->fd == -1) {
+        perror(path);
+        free(lg);
+        return -1;
+    }
+    off_t size = lseek(lg->fd, 0, SEEK_END);
+    lg->cap = size > LOG_INITIAL ? (size_t)size : LOG_INITIAL;
+    if ((size_t)size < lg->cap && ftruncate(lg->fd, lg->cap) == -1) {
+        perror("ftruncate");
+        close(lg->fd);
+        free(lg);
+        return -1;
+    }
+    lg->map = mmap(NULL, lg->cap, PROT_READ | PROT_WRITE, MAP_SHARED, lg->fd, 0);
+    if (lg->map == MAP_FAILED) {
+        perror("mmap");
+        close(lg->fd);
+        free(lg);
+        return -1;
+    }
+
+    size_t off = 0;
+    int nrecs = 0;
+    while (off + sizeof(struct log_rec) <= lg->cap) {
+        struct log_rec *rec = (struct log_rec *)(lg->map + off);
+        if (rec->len == 0) break;
+        size_t sz = log_rec_size(rec->room_len, rec->len);
+        // a torn or foreign tail ends the log
+        if (rec->room_len == 0 || rec->room_len > MAX_ROOM_NAME || off + sz > lg->cap || rec->prev > off) break;
+        uint32_t hash = room_hash(rec->data, rec->room_len);
+        struct hist_room *e = hist_lookup(hist_stripe_of(hash), rec->data, rec->room_len, hash, 1);
+        if (e == NULL) break;
+        e->log_last = off + 1;
+        off += sz;
+        nrecs++;
+    }
+    // drop whatever follows the last good record
+    memset(lg->map + off, 0, lg->cap - off < sizeof(struct log_rec) ? lg->cap - off : sizeof(struct log_rec));
+    lg->len = off;
+    hist_log = lg;
+    printf("History log %s: %d records\n", path, nrecs);
+    return 0;
+}
+
+void hist_init(void) {
+    for (int i = 0; i < HIST_STRIPES; ++i) pthread_mutex_init(&hist_stripes[i].lock, NULL);
+}
 
-    fd_set master, read_fds;
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
+// A shard gained its first member of a room: take a reference on the room's
+// history entry. NULL when history is off or memory is short; the room then
+// just has no history.
+struct hist_room *hist_attach(const char *name, int len, uint32_t hash) {
+    if (history_lines == 0) return NULL;
+    struct hist_stripe *st = hist_stripe_of(hash);
+    pthread_mutex_lock(&st->lock);
+    struct hist_room *e = hist_lookup(st, name, len, hash, 1);
+    if (e != NULL && e->nshards++ == 0 && e->log_last != 0 && (e->h = hist_alloc()) != NULL) log_fill(e);
+    pthread_mutex_unlock(&st->lock);
+    return e;
+}
+
+// The last shard to leave a room gives its ring back to the slab. Without a
+// log the entry goes too; with one it stays as the way into the room's records.
+void hist_detach(struct hist_room *e) {
+    if (e == NULL) return;
+    struct hist_stripe *st = hist_stripe_of(e->hash);
+    pthread_mutex_lock(&st->lock);
+    if (--e->nshards == 0) {
+        if (e->h != NULL) hist_release(e->h);
+        e->h = NULL;
+        if (e->log_last == 0) hist_unlink(st, e);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Record a room message and stamp it with its history serial.
+void hist_append(struct hist_room *e, struct msgbuf *m) {
+    if (e == NULL) return;
+    struct hist_stripe *st = hist_stripe_of(e->hash);
+    pthread_mutex_lock(&st->lock);
+    m->seq = __atomic_add_fetch(&hist_seq, 1, __ATOMIC_RELAXED);
+    if (e->h == NULL) e->h = hist_alloc();
+    if (e->h != NULL) hist_push(e->h, m->data, m->len);
+    if (hist_log != NULL) log_append(e, m->data, m->len);
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Copy a room's history into one message for a joining client. *since is
+// set to the first serial the joiner must still get live; everything older
+// is either in the copy or predates the join.
+struct msgbuf *hist_replay(struct hist_room *e, uint64_t *since) {
+    *since = 0;
+    if (e == NULL) return NULL;
+    struct msgbuf *m = NULL;
+    struct hist_stripe *st = hist_stripe_of(e->hash);
+    pthread_mutex_lock(&st->lock);
+    *since = __atomic_load_n(&hist_seq, __ATOMIC_RELAXED) + 1;
+    struct history *h = e->h;
+    if (h != NULL && h->count > 0) {
+        uint32_t from = h->start[h->first];
+        uint32_t len = h->tail - from;
+        if ((m = msg_new(len)) != NULL) {
+            uint32_t pos = from & (HISTORY_BYTES - 1);
+            uint32_t n = len < HISTORY_BYTES - pos ? len : HISTORY_BYTES - pos;
+            memcpy(m->data, h->bytes + pos, n);
+            memcpy(m->data + n, h->bytes, len - n);
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return m;
+}
 
-    FD_SET(listener, &master);
-    int fdmax = listener;
+int mbox_init(struct mailbox *mb) {
+    mb->stub.next = NULL;
+    mb->head = &mb->stub;
+    mb->tail = &mb->stub;
+    mb->signalled = 0;
+    mb->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mb->evfd == -1 ? -1 : 0;
+}
 
-    int clients[MAX_CLIENTS];
-    int client_id[MAX_CLIENTS];
-    for (int i = 0; i < MAX_CLIENTS; ++i) { clients[i] = -1; client_id[i] = -1; }
-    int next_id = 1;
+void mbox_push(struct mailbox *mb, struct mbox_node *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    struct mbox_node *prev = __atomic_exchange_n(&mb->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
 
+// Pop the oldest node, or NULL when the mailbox is empty. A producer caught
+// between its exchange and its link is waited out, since its node is next.
+struct mbox_node *mbox_pop(struct mailbox *mb) {
     while (1) {
-        read_fds = master;
-        if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
-            perror("select");
-            exit(EXIT_FAILURE);
+        struct mbox_node *tail = mb->tail;
+        struct mbox_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (tail == &mb->stub) {
+            if (next == NULL) {
+                if (__atomic_load_n(&mb->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+                sched_yield();
+                continue;
+            }
+            mb->tail = next;
+            tail = next;
+            next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        }
+        if (next != NULL) {
+            mb->tail = next;
+            return tail;
+        }
+        if (__atomic_load_n(&mb->head, __ATOMIC_ACQUIRE) != tail) {
+            sched_yield();
+            continue;
+        }
+        // tail is the last real node: park the stub behind it so it can be handed out
+        mbox_push(mb, &mb->stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (next != NULL) {
+            mb->tail = next;
+            return tail;
         }
+    }
+}
 
-        // check all fds
-        for (int fd = 0; fd <= fdmax; ++fd) {
-            if (!FD_ISSET(fd, &read_fds)) continue;
+// Hand m to another shard, waking it if it has not been signalled yet.
+void mbox_post(struct shard *to, struct msgbuf *m) {
+    struct mbox_node *n = malloc(sizeof *n);
+    if (n == NULL) {
+        perror("Failed to allocate mailbox node");
+        return;
+    }
+    msg_ref(m);
+    n->m = m;
+    mbox_push(&to->mbox, n);
+    if (__atomic_exchange_n(&to->mbox.signalled, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        if (write(to->mbox.evfd, &one, sizeof one) == -1 && errno != EAGAIN) perror("eventfd write");
+    }
+}
 
-            if (fd == listener) {
-                // new connection
-                struct sockaddr_storage remoteaddr;
-                socklen_t addrlen = sizeof remoteaddr;
-                int newfd = accept(listener, (struct sockaddr*)&remoteaddr, &addrlen);
-                if (newfd == -1) {
-                    perror("accept");
-                    continue;
-                }
+// Grow an int array to hold at least `need` entries, filling new ones with -1.
+int grow_ints(int **arr, int *cap, int need) {
+    if (need <= *cap) return 0;
+    int newcap = *cap ? *cap : INITIAL_CLIENTS;
+    while (newcap < need) newcap *= 2;
+    int *grown = realloc(*arr, newcap * sizeof *grown);
+    if (grown == NULL) return -1;
+    for (int i = *cap; i < newcap; ++i) grown[i] = -1;
+    *arr = grown;
+    *cap = newcap;
+    return 0;
+}
+
+// Look up the client owning fd, or NULL.
+struct client *find_client(struct shard *sh, int fd) {
+    if (fd < 0 || fd >= sh->fd_slot_cap || sh->fd_slot[fd] == -1) return NULL;
+    return &sh->clients[sh->fd_slot[fd]];
+}
+
+struct room *room_find(struct shard *sh, const char *name, int len, uint32_t hash) {
+    if (sh->nbuckets == 0) return NULL;
+    for (struct room *r = sh->room_buckets[hash & (sh->nbuckets - 1)]; r != NULL; r = r->next) {
+        if (r->hash == hash && r->name_len == len && memcmp(r->name, name, len) == 0) return r;
+    }
+    return NULL;
+}
+
+// Move every room into a table of nbuckets buckets.
+int room_rehash(struct shard *sh, int nbuckets) {
+    struct room **buckets = calloc(nbuckets, sizeof *buckets);
+    if (buckets == NULL) return -1;
+    for (int i = 0; i < sh->nbuckets; ++i) {
+        struct room *r = sh->room_buckets[i];
+        while (r != NULL) {
+            struct room *next = r->next;
+            struct room **head = &buckets[r->hash & (nbuckets - 1)];
+            r->next = *head;
+            *head = r;
+            r = next;
+        }
+    }
+    free(sh->room_buckets);
+    sh->room_buckets = buckets;
+    sh->nbuckets = nbuckets;
+    return 0;
+}
+
+// Look up a room, creating it if it has no members on this shard yet.
+struct room *room_get(struct shard *sh, const char *name, int len) {
+    uint32_t hash = room_hash(name, len);
+    struct room *r = room_find(sh, name, len, hash);
+    if (r != NULL) return r;
+    // keep the load factor at or below one; a failed grow only costs longer chains
+    if (sh->nrooms >= sh->nbuckets) {
+        int nbuckets = sh->nbuckets ? sh->nbuckets * 2 : INITIAL_ROOM_BUCKETS;
+        if (room_rehash(sh, nbuckets) == -1 && sh->nbuckets == 0) return NULL;
+    }
+    r = malloc(sizeof *r + len + 1);
+    if (r == NULL) return NULL;
+    r->hash = hash;
+    r->hist = hist_attach(name, len, hash);
+    r->members = NULL;
+    r->nmembers = r->cap = 0;
+    r->name_len = len;
+    memcpy(r->name, name, len);
+    r->name[len] = '\0';
+    struct room **head = &sh->room_buckets[hash & (sh->nbuckets - 1)];
+    r->next = *head;
+    *head = r;
+    sh->nrooms++;
+    return r;
+}
+
+// Unlink and free a room whose last local member has left.
+void room_free(struct shard *sh, struct room *r) {
+    struct room **pp = &sh->room_buckets[r->hash & (sh->nbuckets - 1)];
+    while (*pp != r) pp = &(*pp)->next;
+    *pp = r->next;
+    sh->nrooms--;
+    hist_detach(r->hist);
+    free(r->members);
+    free(r);
+    // give the buckets back too once most rooms are gone
+    if (sh->nbuckets > INITIAL_ROOM_BUCKETS && sh->nrooms < sh->nbuckets / 8) {
+        room_rehash(sh, sh->nbuckets / 2);
+    }
+}
+
+// Position of r in the client's rooms[], or -1. Scans whichever of the two
+// membership lists is shorter.
+int room_index(struct shard *sh, struct client *c, struct room *r) {
+    if (c->nrooms <= r->nmembers) {
+        for (int i = 0; i < c->nrooms; ++i) {
+            if (c->rooms[i].room == r) return i;
+        }
+    } else {
+        int slot = c - sh->clients;
+        for (int i = 0; i < r->nmembers; ++i) {
+            if (r->members[i].slot == slot) return r->members[i].cidx;
+        }
+    }
+    return -1;
+}
+
+int room_join(struct shard *sh, struct client *c, struct room *r, uint64_t since) {
+    if (c->nrooms == c->roomcap) {
+        int newcap = c->roomcap ? c->roomcap * 2 : INITIAL_ROOM_MEMBERS;
+        struct client_room *grown = realloc(c->rooms, newcap * sizeof *grown);
+        if (grown == NULL) return -1;
+        c->rooms = grown;
+        c->roomcap = newcap;
+    }
+    if (r->nmembers == r->cap) {
+        int newcap = r->cap ? r->cap * 2 : INITIAL_ROOM_MEMBERS;
+        struct room_member *grown = realloc(r->members, newcap * sizeof *grown);
+        if (grown == NULL) return -1;
+        r->members = grown;
+        r->cap = newcap;
+    }
+    r->members[r->nmembers] = (struct room_member){ c - sh->clients, c->nrooms, since };
+    c->rooms[c->nrooms] = (struct client_room){ r, r->nmembers };
+    r->nmembers++;
+    c->nrooms++;
+    return 0;
+}
+
+// Take the client out of its cidx'th room: swap-remove on both sides, then
+// free the room if that was its last member here.
+void room_leave(struct shard *sh, struct client *c, int cidx) {
+    struct client_room cr = c->rooms[cidx];
+    struct room *r = cr.room;
+
+    struct room_member last = r->members[--r->nmembers];
+    if (cr.ridx != r->nmembers) {
+        r->members[cr.ridx] = last;
+        sh->clients[last.slot].rooms[last.cidx].ridx = cr.ridx;
+    }
+    struct client_room clast = c->rooms[--c->nrooms];
+    if (cidx != c->nrooms) {
+        c->rooms[cidx] = clast;
+        clast.room->members[clast.ridx].cidx = cidx;
+    }
+
+    if (c->cur == r) c->cur = c->nrooms > 0 ? c->rooms[c->nrooms - 1].room : NULL;
+    if (r->nmembers == 0) room_free(sh, r);
+}
+
+// Register fd as a live client and return its slot, or NULL on allocation failure.
+struct client *add_client(struct shard *sh, int fd, int id) {
+    if (sh->nfree == 0) {
+        // no free slot: double the slot storage and push the new slots
+        int newslots = sh->nslots ? sh->nslots * 2 : INITIAL_CLIENTS;
+        struct client *grown = realloc(sh->clients, newslots * sizeof *grown);
+        if (grown == NULL) return NULL;
+        sh->clients = grown;
+        int *grown_free = realloc(sh->free_slots, newslots * sizeof *grown_free);
+        if (grown_free == NULL) return NULL;
+        sh->free_slots = grown_free;
+        int *grown_members = realloc(sh->members, newslots * sizeof *grown_members);
+        if (grown_members == NULL) return NULL;
+        sh->members = grown_members;
+        // push in reverse so low slots are handed out first
+        for (int i = newslots - 1; i >= sh->nslots; --i) sh->free_slots[sh->nfree++] = i;
+        sh->nslots = newslots;
+    }
+    if (grow_ints(&sh->fd_slot, &sh->fd_slot_cap, fd + 1) == -1) return NULL;
+
+    int slot = sh->free_slots[--sh->nfree];
+    struct client *c = &sh->clients[slot];
+    c->fd = fd;
+    c->id = id;
+    c->member = sh->nmembers;
+    c->closing = 0;
+    c->q = NULL;
+    c->qhead = c->qlen = c->qcap = 0;
+    c->qoff = c->qbytes = 0;
+    c->dirty = 0;
+    c->rbuf = NULL;
+    c->rlen = 0;
+    c->zerocopy = 0;
+    c->zc_seq = 0;
+    c->zc = NULL;
+    c->zchead = c->zclen = c->zccap = 0;
+    c->gen = 0;
+    c->sending = 0;
+    c->qpinned = 0;
+    c->rooms = NULL;
+    c->nrooms = c->roomcap = 0;
+    c->cur = NULL;
+    sh->members[sh->nmembers++] = slot;
+    sh->fd_slot[fd] = slot;
+    return c;
+}
+
+// Release a client's slot: swap-remove it from members[] and recycle the slot.
+void remove_client(struct shard *sh, struct client *c) {
+    int slot = sh->fd_slot[c->fd];
+    counter_add(&sh->stats.queued, -c->qbytes);
+    while (c->qlen > 0) {
+        msg_unref(c->q[c->qhead]);
+        c->qhead = (c->qhead + 1) & (c->qcap - 1);
+        c->qlen--;
+    }
+    free(c->q);
+    c->q = NULL;
+    // the socket is about to be closed, so outstanding completions will never arrive
+    while (c->zclen > 0) {
+        msg_unref(c->zc[c->zchead].m);
+        c->zchead = (c->zchead + 1) & (c->zccap - 1);
+        c->zclen--;
+    }
+    free(c->zc);
+    c->zc = NULL;
+    free(c->rbuf);
+    c->rbuf = NULL;
+    while (c->nrooms > 0) room_leave(sh, c, c->nrooms - 1);
+    free(c->rooms);
+    c->rooms = NULL;
+    int last = sh->members[--sh->nmembers];
+    sh->members[c->member] = last;
+    sh->clients[last].member = c->member;
+    sh->fd_slot[c->fd] = -1;
+    c->fd = -1;
+    c->id = -1;
+    c->member = -1;
+    sh->free_slots[sh->nfree++] = slot;
+}
+
+// Schedule a client to be closed once the current event batch is done, so
+// that broadcast loops never see members[] change underneath them.
+void drop_client(struct shard *sh, struct client *c) {
+    if (c->closing) return;
+    c->closing = 1;
+    if (grow_ints(&sh->closing_fds, &sh->closing_cap, sh->nclosing + 1) == -1) {
+        perror("Failed to grow close list");
+        exit(EXIT_FAILURE);
+    }
+    sh->closing_fds[sh->nclosing++] = c->fd;
+}
+
+// Put a client on the end-of-batch flush list.
+void mark_dirty(struct shard *sh, struct client *c) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    if (grow_ints(&sh->dirty_fds, &sh->dirty_cap, sh->ndirty + 1) == -1) {
+        perror("Failed to grow flush list");
+        exit(EXIT_FAILURE);
+    }
+    sh->dirty_fds[sh->ndirty++] = c->fd;
+}
+
+// Append m to the client's outbound ring, growing it if needed.
+// The ring takes over the caller's reference.
+int queue_push(struct client *c, struct msgbuf *m) {
+    if (c->qlen == c->qcap) {
+        int newcap = c->qcap ? c->qcap * 2 : INITIAL_QUEUE;
+        struct msgbuf **grown = malloc(newcap * sizeof *grown);
+        if (grown == NULL) return -1;
+        // unwrap the old ring into the start of the new one
+        for (int i = 0; i < c->qlen; ++i) grown[i] = c->q[(c->qhead + i) & (c->qcap - 1)];
+        free(c->q);
+        c->q = grown;
+        c->qhead = 0;
+        c->qcap = newcap;
+    }
+    c->q[(c->qhead + c->qlen) & (c->qcap - 1)] = m;
+    c->qlen++;
+    c->qbytes += m->len;
+    return 0;
+}
+
+// Drop the oldest message that has not started going out on the wire.
+// A partially sent head, or anything an in-flight send refers to, must be
+// finished or the stream would be corrupted.
+int queue_drop_oldest(struct client *c) {
+    int keep = c->qpinned > 0 ? c->qpinned : (c->qoff > 0);
+    if (c->qlen <= keep) return -1;
+    int mask = c->qcap - 1;
+    struct msgbuf *m = c->q[(c->qhead + keep) & mask];
+    // slide the kept entries up one slot over the victim
+    for (int i = keep; i > 0; --i) c->q[(c->qhead + i) & mask] = c->q[(c->qhead + i - 1) & mask];
+    c->qhead = (c->qhead + 1) & mask;
+    c->qlen--;
+    c->qbytes -= m->len;
+    msg_unref(m);
+    return 0;
+}
 
-                // add to clients array
-                int slot = -1;
-                for (int i = 0; i < MAX_CLIENTS; ++i) {
-                    if (clients[i] == -1) { slot = i; break; }
+// Describe up to IOV_BATCH queued buffers, starting at the unsent part of the
+// head, as iovecs. If ms is given each buffer is also referenced there.
+int queue_fill_iov(struct client *c, struct iovec *iov, struct msgbuf **ms, size_t *total) {
+    int cnt = 0;
+    *total = 0;
+    for (; cnt < c->qlen && cnt < IOV_BATCH; ++cnt) {
+        struct msgbuf *m = c->q[(c->qhead + cnt) & (c->qcap - 1)];
+        size_t off = (cnt == 0) ? c->qoff : 0;
+        iov[cnt].iov_base = m->data + off;
+        iov[cnt].iov_len = m->len - off;
+        *total += m->len - off;
+        if (ms != NULL) {
+            msg_ref(m);
+            ms[cnt] = m;
+        }
+    }
+    return cnt;
+}
+
+// Retire n bytes that the socket accepted from the front of the queue.
+void queue_consume(struct client *c, size_t n) {
+    while (n > 0) {
+        struct msgbuf *m = c->q[c->qhead];
+        size_t chunk = m->len - c->qoff;
+        if (n < chunk) {
+            c->qoff += n;
+            c->qbytes -= n;
+            return;
+        }
+        n -= chunk;
+        c->qbytes -= chunk;
+        c->qoff = 0;
+        c->qhead = (c->qhead + 1) & (c->qcap - 1);
+        c->qlen--;
+        msg_unref(m);
+    }
+}
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Hand queued SQEs to the kernel and optionally wait for `wait` completions.
+// Returns 1 if the kernel took nothing because completions are backed up.
+int uring_submit(struct uring *ur, unsigned wait) {
+    __atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+    int rc = sys_io_uring_enter(ur->fd, ur->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (rc == -1) {
+        if (errno == EINTR) return 0;
+        // EBUSY while the CQ overflows: the caller has to reap first
+        if (errno == EBUSY || errno == EAGAIN) return 1;
+        perror("io_uring_enter");
+        return -1;
+    }
+    ur->pending -= rc;
+    return 0;
+}
+
+// Move every completion on the ring into the stash so the kernel can post
+// (and flush its overflow list) again. Returns how many moved, or -1.
+int uring_stash_cqes(struct uring *ur) {
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
+    unsigned n = tail - head;
+    if (ur->stash_len + n > ur->stash_cap) {
+        unsigned newcap = ur->stash_cap ? ur->stash_cap : *ur->cq_mask + 1;
+        while (newcap < ur->stash_len + n) newcap *= 2;
+        struct io_uring_cqe *grown = realloc(ur->stash, newcap * sizeof *grown);
+        if (grown == NULL) return -1;
+        ur->stash = grown;
+        ur->stash_cap = newcap;
+    }
+    for (; head != tail; ++head) ur->stash[ur->stash_len++] = ur->cqes[head & *ur->cq_mask];
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    return (int)n;
+}
+
+// Next completion, stashed ones first. Returns 0 when there is none.
+int uring_next_cqe(struct uring *ur, struct io_uring_cqe *cqe) {
+    if (ur->stash_head < ur->stash_len) {
+        *cqe = ur->stash[ur->stash_head++];
+        if (ur->stash_head == ur->stash_len) ur->stash_head = ur->stash_len = 0;
+        return 1;
+    }
+    unsigned head = *ur->cq_head;
+    if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = ur->cqes[head & *ur->cq_mask];
+    __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Next free SQE, zeroed. Submits first if the ring is full; if the kernel
+// refuses because the CQ is backed up, the completions are stashed to make
+// room. Returns NULL if that cannot free a slot either.
+struct io_uring_sqe *uring_get_sqe(struct uring *ur) {
+    while (ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+        int rc = uring_submit(ur, 0);
+        if (rc == -1) return NULL;
+        if (rc == 1 && uring_stash_cqes(ur) <= 0) {
+            fprintf(stderr, "io_uring: submission queue stuck full\n");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ur->sqes[ur->sq_local & *ur->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ur->sq_local++;
+    ur->pending++;
+    return sqe;
+}
+
+// Give a provided buffer back to the kernel.
+void uring_recycle(struct uring *ur, unsigned bid) {
+    struct io_uring_buf *b = &ur->br->bufs[ur->br_tail & (UR_BUFS - 1)];
+    b->addr = (uintptr_t)(ur->bufs + (size_t)bid * UR_BUF_SZ);
+    b->len = UR_BUF_SZ;
+    b->bid = bid;
+    ur->br_tail++;
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+void uring_free(struct uring *ur) {
+    if (ur->fd != -1) close(ur->fd);
+    if (ur->ring_mem != NULL && ur->ring_mem != MAP_FAILED) munmap(ur->ring_mem, ur->ring_sz);
+    if (ur->sqes != NULL && ur->sqes != MAP_FAILED) munmap(ur->sqes, ur->sqes_sz);
+    if (ur->br != NULL && ur->br != MAP_FAILED) munmap(ur->br, UR_BUFS * sizeof(struct io_uring_buf));
+    free(ur->bufs);
+    free(ur->stash);
+    free(ur);
+}
+
+// Multishot recv (Linux 6.0) is newer than anything else the engine uses
+// and the opcode probe cannot see it, so try one on a socketpair that holds
+// a byte and then EOF. Returns 0 if the byte came back.
+int uring_probe_recv(struct uring *ur) {
+    int sv[2], works = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    struct io_uring_sqe *sqe;
+    if (write(sv[1], "x", 1) == 1 && shutdown(sv[1], SHUT_WR) == 0 && (sqe = uring_get_sqe(ur)) != NULL) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = UR_BGID;
+        // the EOF ends the request, so this never waits for long
+        int more = 1;
+        while (more && uring_submit(ur, 1) == 0) {
+            struct io_uring_cqe cqe;
+            while (more && uring_next_cqe(ur, &cqe)) {
+                if (cqe.res > 0) {
+                    works = 1;
+                    uring_recycle(ur, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
                 }
-                if (slot == -1) {
-                    const char *msg = "Server full, try later.\n";
-                    send(newfd, msg, strlen(msg), 0);
-                    close(newfd);
-                    continue;
+                more = cqe.flags & IORING_CQE_F_MORE;
+            }
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return works ? 0 : -1;
+}
+
+// Set up a ring and check the kernel has everything the engine relies on.
+// Returns NULL (after saying why) if the shard has to stay on epoll.
+struct uring *uring_init(void) {
+    struct uring *ur = calloc(1, sizeof *ur);
+    if (ur == NULL) return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = UR_ENTRIES * 4;
+    ur->fd = sys_io_uring_setup(UR_ENTRIES, &p);
+    if (ur->fd == -1) {
+        perror("io_uring_setup");
+        free(ur);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+        fprintf(stderr, "io_uring: kernel lacks required features\n");
+        uring_free(ur);
+        return NULL;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ur->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    ur->ring_mem = mmap(NULL, ur->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ur->fd, IORING_OFF_SQ_RING);
+    ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ur->fd, IORING_OFF_SQES);
+    if (ur->ring_mem == MAP_FAILED || ur->sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        uring_free(ur);
+        return NULL;
+    }
+    char *ring = ur->ring_mem;
+    ur->sq_entries = p.sq_entries;
+    ur->sq_head = (unsigned *)(ring + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    ur->sq_local = *ur->sq_tail;
+    // SQE slots are used in ring order, so the indirection array is the identity
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+    ur->cq_head = (unsigned *)(ring + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // every opcode the engine submits has to be supported
+    size_t probe_sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_sz);
+    if (probe == NULL || sys_io_uring_register(ur->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        perror("io_uring probe");
+        free(probe);
+        uring_free(ur);
+        return NULL;
+    }
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD };
+    for (size_t i = 0; i < sizeof needed / sizeof needed[0]; ++i) {
+        int op = needed[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "io_uring: opcode %d not supported\n", op);
+            free(probe);
+            uring_free(ur);
+            return NULL;
+        }
+    }
+    free(probe);
+
+    // provided buffer ring for recv (Linux 5.19+)
+    ur->br = mmap(NULL, UR_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ur->bufs = malloc((size_t)UR_BUFS * UR_BUF_SZ);
+    if (ur->br == MAP_FAILED || ur->bufs == NULL) {
+        perror("io_uring buffers");
+        uring_free(ur);
+        return NULL;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uintptr_t)ur->br;
+    reg.ring_entries = UR_BUFS;
+    reg.bgid = UR_BGID;
+    if (sys_io_uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring provided buffers");
+        uring_free(ur);
+        return NULL;
+    }
+    for (unsigned i = 0; i < UR_BUFS; ++i) uring_recycle(ur, i);
+    if (uring_probe_recv(ur) == -1) {
+        fprintf(stderr, "io_uring: multishot recv not supported\n");
+        uring_free(ur);
+        return NULL;
+    }
+    return ur;
+}
+
+uint64_t ud_conn(int type, int fd, uint32_t gen) {
+    return (uint64_t)fd << 32 | (uint64_t)(gen & UD_GEN_MASK) << 3 | type;
+}
+
+int uring_arm_accept(struct shard *sh) {
+    struct io_uring_sqe *sqe = uring_get_sqe(sh->ur);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sh->listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = UD_ACCEPT;
+    return 0;
+}
+
+int uring_arm_mbox(struct shard *sh) {
+    struct io_uring_sqe *sqe = uring_get_sqe(sh->ur);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sh->mbox.evfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UD_MBOX;
+    return 0;
+}
+
+int uring_arm_recv(struct shard *sh, struct client *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(sh->ur);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->user_data = ud_conn(UD_RECV, c->fd, c->gen);
+    return 0;
+}
+
+void drop_client(struct shard *sh, struct client *c);
+
+// Submit one sendmsg covering the client's queue, unless one is in flight.
+void uring_flush(struct shard *sh, struct client *c) {
+    if (c->sending || c->qlen == 0 || c->closing) return;
+
+    struct send_op *op = sh->free_ops;
+    if (op != NULL) {
+        sh->free_ops = op->next;
+    } else if ((op = malloc(sizeof *op)) == NULL) {
+        drop_client(sh, c);
+        return;
+    }
+    size_t total;
+    op->fd = c->fd;
+    op->gen = c->gen;
+    op->nmsgs = queue_fill_iov(c, op->iov, op->m, &total);
+    memset(&op->mh, 0, sizeof op->mh);
+    op->mh.msg_iov = op->iov;
+    op->mh.msg_iovlen = op->nmsgs;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(sh->ur);
+    if (sqe == NULL) {
+        for (int i = 0; i < op->nmsgs; ++i) msg_unref(op->m[i]);
+        op->next = sh->free_ops;
+        sh->free_ops = op;
+        drop_client(sh, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)&op->mh;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)op | UD_SEND;
+    c->sending = 1;
+    c->qpinned = op->nmsgs;
+}
+
+// Keep an extra reference on m until zerocopy send `seq` completes.
+int zc_push(struct client *c, uint32_t seq, struct msgbuf *m) {
+    if (c->zclen == c->zccap) {
+        int newcap = c->zccap ? c->zccap * 2 : INITIAL_QUEUE;
+        struct zcref *grown = malloc(newcap * sizeof *grown);
+        if (grown == NULL) return -1;
+        for (int i = 0; i < c->zclen; ++i) grown[i] = c->zc[(c->zchead + i) & (c->zccap - 1)];
+        free(c->zc);
+        c->zc = grown;
+        c->zchead = 0;
+        c->zccap = newcap;
+    }
+    msg_ref(m);
+    c->zc[(c->zchead + c->zclen) & (c->zccap - 1)] = (struct zcref){ seq, m };
+    c->zclen++;
+    return 0;
+}
+
+// Read MSG_ZEROCOPY completions off the error queue and release the buffers
+// they pinned. TCP completes sends in order, so ranges retire from the front.
+void reap_zerocopy(struct client *c) {
+    while (1) {
+        char control[128];
+        struct msghdr mh = { .msg_control = control, .msg_controllen = sizeof control };
+        if (recvmsg(c->fd, &mh, MSG_ERRQUEUE) == -1) return;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t hi = ee->ee_data;
+            while (c->zclen > 0 && (int32_t)(c->zc[c->zchead].seq - hi) <= 0) {
+                msg_unref(c->zc[c->zchead].m);
+                c->zchead = (c->zchead + 1) & (c->zccap - 1);
+                c->zclen--;
+            }
+        }
+    }
+}
+
+// Write as much of the outbound queue as the socket accepts, gathering up to
+// IOV_BATCH pending buffers into each sendmsg().
+void flush_client(struct shard *sh, struct client *c) {
+    if (sh->ur != NULL) {
+        uring_flush(sh, c);
+        return;
+    }
+    while (c->qlen > 0 && !c->closing) {
+        struct iovec iov[IOV_BATCH];
+        size_t total;
+        int cnt = queue_fill_iov(c, iov, NULL, &total);
+
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = cnt };
+        int zerocopy = c->zerocopy && total >= zerocopy_min;
+        ssize_t n = sendmsg(c->fd, &mh, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (zerocopy && errno == ENOBUFS) {
+                // out of optmem for pinned pages; fall back to copying for now
+                c->zerocopy = 0;
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) drop_client(sh, c);
+            // otherwise wait for EPOLLOUT
+            return;
+        }
+
+        if (zerocopy) {
+            // the kernel still reads from every buffer this send touched
+            // until the completion for `seq` arrives
+            uint32_t seq = c->zc_seq++;
+            size_t covered = 0;
+            for (int i = 0; covered < (size_t)n; ++i) {
+                if (zc_push(c, seq, c->q[(c->qhead + i) & (c->qcap - 1)]) == -1) {
+                    drop_client(sh, c);
+                    return;
                 }
+                covered += iov[i].iov_len;
+            }
+        }
+        queue_consume(c, n);
+        counter_add(&sh->stats.bytes_out, n);
+        counter_add(&sh->stats.queued, -(uint64_t)n);
+        if ((size_t)n < total) return;
+    }
+}
+
+// Flush every client that had data queued during this batch, so several
+// broadcasts to the same recipient go out in one system call.
+void flush_dirty(struct shard *sh) {
+    for (int i = 0; i < sh->ndirty; ++i) {
+        struct client *c = find_client(sh, sh->dirty_fds[i]);
+        if (c == NULL) continue;
+        c->dirty = 0;
+        flush_client(sh, c);
+    }
+    sh->ndirty = 0;
+}
+
+// Queue a reference to m for one client and apply the slow-consumer policy.
+void send_to_client(struct shard *sh, struct client *c, struct msgbuf *m) {
+    if (c->closing) return;
+
+    // over the mark: try the socket before deciding the client is slow
+    if (c->qbytes + m->len > high_water) flush_client(sh, c);
+    while (c->qbytes + m->len > high_water && !c->closing) {
+        if (slow_policy == POLICY_DISCONNECT) {
+            char msg[64];
+            log_write(sh, msg, snprintf(msg, sizeof msg, "Client %d is too slow, disconnecting\n", c->id));
+            counter_add(&sh->stats.evicted, 1);
+            drop_client(sh, c);
+            return;
+        }
+        size_t before = c->qbytes;
+        if (queue_drop_oldest(c) == -1) break;
+        counter_add(&sh->stats.dropped, 1);
+        counter_add(&sh->stats.queued, c->qbytes - before);
+    }
+
+    if (c->closing) return;
+    msg_ref(m);
+    if (queue_push(c, m) == -1) {
+        msg_unref(m);
+        drop_client(sh, c);
+        return;
+    }
+    counter_add(&sh->stats.msgs_out, 1);
+    counter_add(&sh->stats.queued, m->len);
+    gauge_max(&sh->stats.queue_peak, c->qbytes);
+    mark_dirty(sh, c);
+}
+
+// Queue m for every member of its room on this shard except the sender.
+void deliver_local(struct shard *sh, int sender_fd, struct msgbuf *m) {
+    struct room *r = room_find(sh, m->data + m->len, m->room_len, m->room_hash);
+    if (r == NULL) return;
+    uint64_t start = now_ns();
+    for (int i = 0; i < r->nmembers; ++i) {
+        struct client *c = &sh->clients[r->members[i].slot];
+        // messages already in a joiner's history replay are skipped
+        if (c->fd != sender_fd && m->seq >= r->members[i].since) send_to_client(sh, c, m);
+    }
+    hdr_record_shared(&sh->stats.fanout_ns, now_ns() - start);
+}
+
+// Address m to room r, record it in the room's history and queue it for
+// every member of the room on every shard except the sender. Shards without
+// members just miss the room lookup. The caller keeps its own reference.
+void broadcast_msg(struct shard *sh, int sender_fd, struct room *r, struct msgbuf *m) {
+    msg_set_room(m, r->name, r->name_len, r->hash);
+    hist_append(r->hist, m);
+    deliver_local(sh, sender_fd, m);
+    for (int i = 0; i < nthreads; ++i) {
+        if (&shards[i] != sh) mbox_post(&shards[i], m);
+    }
+}
+
+void broadcast(struct shard *sh, int sender_fd, struct room *r, const char *msg, size_t msglen) {
+    struct msgbuf *m = msg_new(msglen);
+    if (m == NULL) {
+        perror("Failed to allocate message");
+        return;
+    }
+    memcpy(m->data, msg, msglen);
+    broadcast_msg(sh, sender_fd, r, m);
+    msg_unref(m);
+}
+
+// Lines in the lobby keep the plain "Client N ..." format; other rooms are tagged.
+int room_tag(char *buf, size_t size, const struct room *r) {
+    if (strcmp(r->name, LOBBY) == 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+    return snprintf(buf, size, "[%s] ", r->name);
+}
+
+// Tell the rest of a room what a client just did.
+void room_notice(struct shard *sh, struct client *c, struct room *r, const char *what) {
+    char tag[MAX_PREFIX];
+    char msg[MAX_PREFIX + 128];
+    room_tag(tag, sizeof tag, r);
+    int len = snprintf(msg, sizeof msg, "%sClient %d %s\n", tag, c->id, what);
+    log_write(sh, msg, len);
+    broadcast(sh, c->fd, r, msg, len);
+}
+
+// Queue a server message for this client only.
+void reply(struct shard *sh, struct client *c, const char *text, size_t len) {
+    struct msgbuf *m = msg_new(len);
+    if (m == NULL) {
+        perror("Failed to allocate message");
+        return;
+    }
+    memcpy(m->data, text, len);
+    send_to_client(sh, c, m);
+    msg_unref(m);
+}
+
+void reply_str(struct shard *sh, struct client *c, const char *text) {
+    reply(sh, c, text, strlen(text));
+}
+
+// Add a client to a room and replay the room's history to it in one message.
+int join_room(struct shard *sh, struct client *c, struct room *r) {
+    uint64_t since;
+    struct msgbuf *m = hist_replay(r->hist, &since);
+    if (room_join(sh, c, r, since) == -1) {
+        if (m != NULL) msg_unref(m);
+        return -1;
+    }
+    if (m != NULL) {
+        send_to_client(sh, c, m);
+        msg_unref(m);
+    }
+    return 0;
+}
+
+// Deliver everything other shards have posted since the last wakeup.
+void drain_mailbox(struct shard *sh) {
+    uint64_t count;
+    if (read(sh->mbox.evfd, &count, sizeof count) == -1 && errno != EAGAIN) perror("eventfd read");
+    // clear the flag before draining so a push racing with the drain signals again
+    __atomic_store_n(&sh->mbox.signalled, 0, __ATOMIC_SEQ_CST);
+    struct mbox_node *n;
+    while ((n = mbox_pop(&sh->mbox)) != NULL) {
+        deliver_local(sh, -1, n->m);
+        msg_unref(n->m);
+        free(n);
+    }
+}
+
+// Take on a freshly accepted socket: register it with the shard's engine,
+// greet it and announce it to everyone else.
+void open_client(struct shard *sh, int newfd, struct sockaddr_storage *remoteaddr) {
+    struct client *c = add_client(sh, newfd, 0);
+    if (c == NULL) {
+        const char *msg = "Server full, try later.\n";
+        send(newfd, msg, strlen(msg), MSG_NOSIGNAL);
+        close(newfd);
+        return;
+    }
+
+    if (sh->ur != NULL) {
+        c->gen = sh->next_gen++;
+        if (uring_arm_recv(sh, c) == -1) {
+            remove_client(sh, c);
+            close(newfd);
+            return;
+        }
+    } else {
+        struct epoll_event ev;
+        // EPOLLOUT is edge-triggered too, so it only fires when a full
+        // socket buffer drains and never needs to be toggled with EPOLL_CTL_MOD
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = newfd;
+        if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+            perror("epoll_ctl");
+            remove_client(sh, c);
+            close(newfd);
+            return;
+        }
+        if (zerocopy_min > 0) {
+            int one = 1;
+            c->zerocopy = setsockopt(newfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0;
+        }
+    }
+    // Count it now: from here on every failure goes through drop_client(),
+    // whose reaping counts the close, so accepted - closed never underflows.
+    // The remove_client() paths above count neither.
+    counter_add(&sh->stats.accepted, 1);
+    c->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    // greet and announce
+    char addrstr[INET6_ADDRSTRLEN] = "unknown";
+    void *addr;
+    if (((struct sockaddr*)remoteaddr)->sa_family == AF_INET) {
+        addr = &((struct sockaddr_in*)remoteaddr)->sin_addr;
+    } else {
+        addr = &((struct sockaddr_in6*)remoteaddr)->sin6_addr;
+    }
+    inet_ntop(((struct sockaddr*)remoteaddr)->sa_family, addr, addrstr, sizeof addrstr);
+
+    char welcome[256];
+    int id = c->id;
+    int wlen = snprintf(welcome, sizeof welcome, "Welcome! You are Client %d\n", id);
+    struct msgbuf *m = msg_new(wlen);
+    if (m != NULL) {
+        memcpy(m->data, welcome, wlen);
+        send_to_client(sh, c, m);
+        msg_unref(m);
+    }
+
+    struct room *lobby = room_get(sh, LOBBY, strlen(LOBBY));
+    if (lobby == NULL || join_room(sh, c, lobby) == -1) {
+        perror("Failed to join lobby");
+        if (lobby != NULL && lobby->nmembers == 0) room_free(sh, lobby);
+        // the socket may already be armed, so let the normal close path handle it
+        drop_client(sh, c);
+        return;
+    }
+    c->cur = lobby;
+
+    char announce[512];
+    int alen = snprintf(announce, sizeof announce, "Client %d has joined from %s\n", id, addrstr);
+    log_write(sh, announce, alen);
+    broadcast(sh, newfd, lobby, announce, alen);
+}
+
+void accept_clients(struct shard *sh) {
+    // edge-triggered: drain the accept queue until it would block
+    while (1) {
+        struct sockaddr_storage remoteaddr;
+        socklen_t addrlen = sizeof remoteaddr;
+        int newfd = accept4(sh->listener, (struct sockaddr*)&remoteaddr, &addrlen, SOCK_NONBLOCK);
+        if (newfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        open_client(sh, newfd, &remoteaddr);
+    }
+}
+
+// Close every client scheduled by drop_client() and announce the departures.
+// Announcing can schedule further drops, so keep going until the list is empty.
+void reap_clients(struct shard *sh) {
+    while (sh->nclosing > 0) {
+        int fd = sh->closing_fds[--sh->nclosing];
+        struct client *c = find_client(sh, fd);
+        if (c == NULL) continue;
+        counter_add(&sh->stats.closed, 1);
+        // tell each of its rooms before leaving them
+        for (int i = 0; i < c->nrooms; ++i) room_notice(sh, c, c->rooms[i].room, "has disconnected");
+        remove_client(sh, c);
+        // a pending multishot recv holds its own reference to the socket,
+        // so shut it down to make the ring let go; for epoll, closing the fd
+        // also removes it from the set
+        if (sh->ur != NULL) shutdown(fd, SHUT_RDWR);
+        close(fd);
+    }
+}
+
+// Plain lines bound for one room, packed into a single buffer so that a read
+// full of chat goes out as one delivery.
+struct linebatch {
+    struct msgbuf *m;
+    struct room *room;
+    size_t cap;     // payload bound for the lines still to come
+    char prefix[MAX_PREFIX];
+    int plen;
+};
+
+void batch_flush(struct shard *sh, struct client *c, struct linebatch *b) {
+    if (b->m == NULL) return;
+    log_write(sh, b->m->data, b->m->len);
+    broadcast_msg(sh, c->fd, b->room, b->m);
+    msg_unref(b->m);
+    b->m = NULL;
+}
+
+// Append "prefix text\n" for room r, starting a new buffer if the batch was
+// going somewhere else.
+void batch_line(struct shard *sh, struct client *c, struct linebatch *b, struct room *r, const char *text, size_t len) {
+    if (b->m != NULL && b->room != r) batch_flush(sh, c, b);
+    if (b->m == NULL) {
+        if ((b->m = msg_new(b->cap)) == NULL) {
+            perror("Failed to allocate message");
+            return;
+        }
+        b->m->len = 0;
+        b->room = r;
+        b->plen = room_tag(b->prefix, sizeof b->prefix, r);
+        b->plen += snprintf(b->prefix + b->plen, sizeof b->prefix - b->plen, "Client %d: ", c->id);
+    }
+    char *out = b->m->data + b->m->len;
+    memcpy(out, b->prefix, b->plen);
+    memcpy(out + b->plen, text, len);
+    out[b->plen + len] = '\n';
+    b->m->len += b->plen + len + 1;
+}
+
+int valid_room_name(const char *name, size_t len) {
+    if (len == 0 || len > MAX_ROOM_NAME) return 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (!isalnum((unsigned char)name[i]) && strchr("_-.#", name[i]) == NULL) return 0;
+    }
+    return 1;
+}
+
+void list_rooms(struct shard *sh, struct client *c) {
+    struct msgbuf *m = msg_new((size_t)c->nrooms * (MAX_ROOM_NAME + 2) + 16);
+    if (m == NULL) {
+        perror("Failed to allocate message");
+        return;
+    }
+    char *out = m->data;
+    out += sprintf(out, "Rooms:");
+    for (int i = 0; i < c->nrooms; ++i) {
+        struct room *r = c->rooms[i].room;
+        *out++ = ' ';
+        memcpy(out, r->name, r->name_len);
+        out += r->name_len;
+        if (r == c->cur) *out++ = '*';
+    }
+    *out++ = '\n';
+    m->len = out - m->data;
+    send_to_client(sh, c, m);
+    msg_unref(m);
+}
+
+// One complete line from a client, without its '\n': either a command or
+// chat for the current room.
+void handle_line(struct shard *sh, struct client *c, struct linebatch *b, const char *line, size_t len) {
+    if (c->closing) return;
+    if (len == 0 || line[0] != '/') {
+        if (c->cur == NULL) {
+            reply_str(sh, c, "You are not in any room, /join one first\n");
+            return;
+        }
+        batch_line(sh, c, b, c->cur, line, len);
+        return;
+    }
+
+    // split "/cmd arg rest", ignoring a trailing '\r'
+    if (line[len - 1] == '\r') len--;
+    const char *end = line + len;
+    const char *cmd = line + 1;
+    const char *p = cmd;
+    while (p < end && *p != ' ') p++;
+    size_t cmdlen = p - cmd;
+    while (p < end && *p == ' ') p++;
+    const char *arg = p;
+    while (p < end && *p != ' ') p++;
+    size_t arglen = p - arg;
+    if (p < end) p++;
+
+    if (cmdlen == 3 && memcmp(cmd, "msg", 3) == 0 && arglen > 0) {
+        // no flush: a /msg to the room being batched joins the batch
+        struct room *r = valid_room_name(arg, arglen) ? room_find(sh, arg, arglen, room_hash(arg, arglen)) : NULL;
+        if (r == NULL || room_index(sh, c, r) == -1) {
+            batch_flush(sh, c, b);
+            reply_str(sh, c, "You are not in that room\n");
+            return;
+        }
+        batch_line(sh, c, b, r, p, end - p);
+        return;
+    }
+
+    // everything else changes membership or answers the sender, so let the
+    // chat before it go first
+    batch_flush(sh, c, b);
+    if (cmdlen == 4 && memcmp(cmd, "join", 4) == 0 && arglen > 0) {
+        if (!valid_room_name(arg, arglen)) {
+            reply_str(sh, c, "Room names are up to 64 letters, digits or _-.#\n");
+            return;
+        }
+        struct room *r = room_get(sh, arg, arglen);
+        if (r == NULL) {
+            perror("Failed to create room");
+            return;
+        }
+        if (room_index(sh, c, r) == -1) {
+            if (join_room(sh, c, r) == -1) {
+                perror("Failed to join room");
+                if (r->nmembers == 0) room_free(sh, r);
+                return;
+            }
+            room_notice(sh, c, r, "has joined");
+        }
+        c->cur = r;
+        char msg[MAX_ROOM_NAME + 32];
+        reply(sh, c, msg, snprintf(msg, sizeof msg, "Now talking in %s\n", r->name));
+    } else if (cmdlen == 5 && memcmp(cmd, "leave", 5) == 0) {
+        struct room *r = c->cur;
+        if (arglen > 0) r = valid_room_name(arg, arglen) ? room_find(sh, arg, arglen, room_hash(arg, arglen)) : NULL;
+        int cidx = r != NULL ? room_index(sh, c, r) : -1;
+        if (cidx == -1) {
+            reply_str(sh, c, "You are not in that room\n");
+            return;
+        }
+        char msg[MAX_ROOM_NAME + 32];
+        int len = snprintf(msg, sizeof msg, "Left %s\n", r->name);
+        room_notice(sh, c, r, "has left");
+        room_leave(sh, c, cidx);
+        reply(sh, c, msg, len);
+    } else if (cmdlen == 5 && memcmp(cmd, "rooms", 5) == 0) {
+        list_rooms(sh, c);
+    } else {
+        reply_str(sh, c, "Commands: /join <room>, /leave [room], /msg <room> <text>, /rooms\n");
+    }
+}
+
+// Handle the client's pending partial line as if it had been terminated.
+void emit_partial(struct shard *sh, struct client *c) {
+    struct linebatch b = { .cap = MAX_PREFIX + c->rlen + 1 };
+    size_t len = c->rlen;
+    c->rlen = 0;
+    counter_add(&sh->stats.lines_in, 1);
+    handle_line(sh, c, &b, c->rbuf, len);
+    batch_flush(sh, c, &b);
+}
+
+// Keep an unterminated tail until the rest of its line arrives. A full
+// MAX_LINE buffer is sent on as a line of its own once a further byte shows
+// the line is longer, as frame_line() cuts a line that arrives whole.
+void stash_partial(struct shard *sh, struct client *c, const char *data, size_t len) {
+    if (len == 0) return;
+    if (c->rbuf == NULL && (c->rbuf = malloc(MAX_LINE)) == NULL) {
+        perror("Failed to allocate line buffer");
+        drop_client(sh, c);
+        return;
+    }
+    while (len > 0) {
+        if (c->rlen == MAX_LINE) emit_partial(sh, c);
+        size_t room = MAX_LINE - c->rlen;
+        size_t n = len < room ? len : room;
+        memcpy(c->rbuf + c->rlen, data, n);
+        c->rlen += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Pieces a complete line of len bytes is cut into.
+size_t line_pieces(size_t len) {
+    return len > MAX_LINE ? (len + MAX_LINE - 1) / MAX_LINE : 1;
+}
+
+// Handle one complete line, cut into MAX_LINE pieces.
+void frame_line(struct shard *sh, struct client *c, struct linebatch *b, const char *line, size_t len) {
+    while (len > MAX_LINE) {
+        handle_line(sh, c, b, line, MAX_LINE);
+        line += MAX_LINE;
+        len -= MAX_LINE;
+    }
+    handle_line(sh, c, b, line, len);
+}
+
+// Frame the bytes of one read into lines. Consecutive chat lines for the
+// same room are packed into a single buffer and delivered in one pass.
+void handle_input(struct shard *sh, struct client *c, const char *data, size_t len) {
+    counter_add(&sh->stats.bytes_in, len);
+    const char *last = memrchr(data, '\n', len);
+    if (last == NULL) {
+        stash_partial(sh, c, data, len);
+        return;
+    }
+
+    size_t done = last + 1 - data;
+    size_t nlines = 0;
+    for (const char *p = data; p < last + 1; ) {
+        const char *nl = memchr(p, '\n', last + 1 - p);
+        // the leading pieces of a line continued from the last read are
+        // sent on by stash_partial()
+        nlines += p == data && c->rlen > 0 ? 1 : line_pieces(nl - p);
+        p = nl + 1;
+    }
+    counter_add(&sh->stats.lines_in, nlines);
+
+    struct linebatch b = { .cap = nlines * MAX_PREFIX + c->rlen + done };
+    const char *p = data;
+    if (c->rlen > 0) {
+        // the first line starts with what the previous read left over
+        const char *nl = memchr(p, '\n', done);
+        stash_partial(sh, c, p, nl - p);
+        size_t rlen = c->rlen;
+        c->rlen = 0;
+        handle_line(sh, c, &b, c->rbuf, rlen);
+        p = nl + 1;
+    }
+    while (p < last + 1) {
+        const char *nl = memchr(p, '\n', last + 1 - p);
+        frame_line(sh, c, &b, p, nl - p);
+        p = nl + 1;
+    }
+    batch_flush(sh, c, &b);
+
+    stash_partial(sh, c, data + done, len - done);
+}
+
+void read_client(struct shard *sh, struct client *c) {
+    int fd = c->fd;
+    // edge-triggered: keep reading until the socket is drained
+    while (!c->closing) {
+        char buf[BUF_SZ];
+        ssize_t nbytes = recv(fd, buf, sizeof buf, 0);
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("recv");
+            drop_client(sh, c);
+            return;
+        }
+        if (nbytes == 0) {
+            // connection closed by client; an unterminated last line still counts
+            if (c->rlen > 0) emit_partial(sh, c);
+            drop_client(sh, c);
+            return;
+        }
+        handle_input(sh, c, buf, nbytes);
+    }
+}
+
+// End of an event batch: flushing can drop clients and dropping announces
+// to others, so repeat until both lists settle.
+void settle(struct shard *sh) {
+    while (sh->ndirty > 0 || sh->nclosing > 0) {
+        flush_dirty(sh);
+        reap_clients(sh);
+    }
+}
+
+void loop_done(struct shard *sh) {
+    counter_add(&sh->stats.loops, 1);
+    hdr_record_shared(&sh->stats.loop_ns, now_ns() - sh->now);
+}
+
+void uring_recv_done(struct shard *sh, struct io_uring_cqe *cqe) {
+    int fd = cqe->user_data >> 32;
+    uint32_t gen = (cqe->user_data >> 3) & UD_GEN_MASK;
+    struct client *c = find_client(sh, fd);
+    int live = c != NULL && (c->gen & UD_GEN_MASK) == gen && !c->closing;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (live && cqe->res > 0) handle_input(sh, c, sh->ur->bufs + (size_t)bid * UR_BUF_SZ, cqe->res);
+        uring_recycle(sh->ur, bid);
+    }
+    if (!live || c->closing) return;
+
+    if (cqe->res == 0) {
+        // connection closed by client; an unterminated last line still counts
+        if (c->rlen > 0) emit_partial(sh, c);
+        drop_client(sh, c);
+        return;
+    }
+    if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+        drop_client(sh, c);
+        return;
+    }
+    // multishot ends when buffers run out or the kernel decides to stop
+    if (!(cqe->flags & IORING_CQE_F_MORE) && uring_arm_recv(sh, c) == -1) drop_client(sh, c);
+}
+
+void uring_send_done(struct shard *sh, struct io_uring_cqe *cqe) {
+    struct send_op *op = (struct send_op *)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_TYPE_MASK);
+    struct client *c = find_client(sh, op->fd);
+    if (c != NULL && c->gen == op->gen) {
+        c->sending = 0;
+        c->qpinned = 0;
+        if (cqe->res < 0) {
+            if (!c->closing) drop_client(sh, c);
+        } else {
+            queue_consume(c, cqe->res);
+            counter_add(&sh->stats.bytes_out, cqe->res);
+            counter_add(&sh->stats.queued, -(uint64_t)cqe->res);
+            // short send, or more was queued meanwhile
+            if (c->qlen > 0) mark_dirty(sh, c);
+        }
+    }
+    for (int i = 0; i < op->nmsgs; ++i) msg_unref(op->m[i]);
+    op->next = sh->free_ops;
+    sh->free_ops = op;
+}
 
-                clients[slot] = newfd;
-                client_id[slot] = next_id++;
-                FD_SET(newfd, &master);
-                if (newfd > fdmax) fdmax = newfd;
-
-                // greet and announce
-                char addrstr[INET6_ADDRSTRLEN];
-                void *addr;
-                if (((struct sockaddr*)&remoteaddr)->sa_family == AF_INET) {
-                    addr = &((struct sockaddr_in*)&remoteaddr)->sin_addr;
-                } else {
-                    addr = &((struct sockaddr_in6*)&remoteaddr)->sin6_addr;
+void *uring_loop(struct shard *sh) {
+    struct uring *ur = sh->ur;
+    if (uring_arm_accept(sh) == -1 || uring_arm_mbox(sh) == -1) exit(EXIT_FAILURE);
+
+    while (1) {
+        // submit everything queued since the last pass and wait for work,
+        // unless stashed completions are still waiting to be handled
+        if (uring_submit(ur, ur->stash_len == 0) == -1) exit(EXIT_FAILURE);
+        sh->now = now_ns();
+
+        struct io_uring_cqe cqe;
+        unsigned handled = 0;
+        while (uring_next_cqe(ur, &cqe)) {
+
+            // a long run of receives would otherwise pile up in the queues
+            // before any send is issued; push them out as we go
+            if (++handled % UR_SETTLE_EVERY == 0) {
+                settle(sh);
+                if (uring_submit(ur, 0) == -1) exit(EXIT_FAILURE);
+            }
+
+            switch (cqe.user_data & UD_TYPE_MASK) {
+            case UD_ACCEPT:
+                if (cqe.res >= 0) {
+                    struct sockaddr_storage remoteaddr;
+                    socklen_t addrlen = sizeof remoteaddr;
+                    memset(&remoteaddr, 0, sizeof remoteaddr);
+                    getpeername(cqe.res, (struct sockaddr *)&remoteaddr, &addrlen);
+                    open_client(sh, cqe.res, &remoteaddr);
+                } else if (cqe.res != -ECONNABORTED) {
+                    fprintf(stderr, "accept: %s\n", strerror(-cqe.res));
                 }
-                inet_ntop(((struct sockaddr*)&remoteaddr)->sa_family, addr, addrstr, sizeof addrstr);
-
-                char welcome[256];
-                int id = client_id[slot];
-                snprintf(welcome, sizeof welcome, "Welcome! You are Client %d\n", id);
-                send(newfd, welcome, strlen(welcome), 0);
-
-                char announce[512];
-                snprintf(announce, sizeof announce, "Client %d has joined from %s\n", id, addrstr);
-                printf("%s", announce);
-                broadcast(newfd, clients, MAX_CLIENTS, announce, strlen(announce));
-            } else {
-                // data from a client
-                char buf[BUF_SZ];
-                ssize_t nbytes = recv(fd, buf, sizeof buf, 0);
-                if (nbytes <= 0) {
-                    // got error or connection closed by client
-                    if (nbytes == 0) {
-                        // find client id
-                        int id = -1;
-                        for (int i = 0; i < MAX_CLIENTS; ++i) if (clients[i] == fd) { id = client_id[i]; clients[i] = -1; client_id[i] = -1; break; }
-                        char msg[128];
-                        if (id != -1) {
-                            snprintf(msg, sizeof msg, "Client %d has disconnected\n", id);
-                            printf("%s", msg);
-                            broadcast(fd, clients, MAX_CLIENTS, msg, strlen(msg));
-                        }
-                    } else {
-                        perror("recv");
-                    }
-                    close(fd);
-                    FD_CLR(fd, &master);
-                } else {
-                    // got message; ensure null-terminated for printing
-                    // trim and broadcast
-                    // find sender id
-                    int id = -1;
-                    for (int i = 0; i < MAX_CLIENTS; ++i) if (clients[i] == fd) { id = client_id[i]; break; }
-                    // ensure message ends with newline
-                    if (nbytes > 0 && buf[nbytes-1] != '\n') {
-                        // append newline in broadcast buffer
-                    }
-                    // prepare broadcast message: "Client N: message"
-                    char outbuf[BUF_SZ + 64];
-                    int outlen = snprintf(outbuf, sizeof outbuf, "Client %d: ", id);
-                    int copylen = (nbytes < (int)(sizeof outbuf - outlen - 1)) ? nbytes : (int)(sizeof outbuf - outlen - 1);
-                    memcpy(outbuf + outlen, buf, copylen);
-                    outlen += copylen;
-                    // ensure newline
-                    if (outlen == 0 || outbuf[outlen-1] != '\n') {
-                        outbuf[outlen++] = '\n';
-                    }
-                    outbuf[outlen] = '\0';
-                    printf("%s", outbuf);
-                    broadcast(fd, clients, MAX_CLIENTS, outbuf, outlen);
+                if (!(cqe.flags & IORING_CQE_F_MORE) && uring_arm_accept(sh) == -1) exit(EXIT_FAILURE);
+                break;
+            case UD_MBOX:
+                drain_mailbox(sh);
+                if (!(cqe.flags & IORING_CQE_F_MORE) && uring_arm_mbox(sh) == -1) exit(EXIT_FAILURE);
+                break;
+            case UD_RECV:
+                uring_recv_done(sh, &cqe);
+                break;
+            case UD_SEND:
+                uring_send_done(sh, &cqe);
+                break;
+            }
+        }
+        settle(sh);
+        loop_done(sh);
+    }
+    return NULL;
+}
+
+void *epoll_loop(struct shard *sh) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(sh->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        sh->now = now_ns();
+
+        // only the fds that are ready are visited
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == sh->listener) {
+                accept_clients(sh);
+                continue;
+            }
+            if (fd == sh->mbox.evfd) {
+                drain_mailbox(sh);
+                continue;
+            }
+            struct client *c = find_client(sh, fd);
+            if (c == NULL || c->closing) continue;
+            if (events[i].events & EPOLLERR) {
+                // zerocopy completions are reported through the error queue;
+                // anything else pending on the socket is a real error
+                int err = 0;
+                socklen_t errlen = sizeof err;
+                if (c->zerocopy) reap_zerocopy(c);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0 || !c->zerocopy) {
+                    drop_client(sh, c);
+                    continue;
                 }
             }
-        } // end for fd loop
+            if (events[i].events & EPOLLHUP) {
+                drop_client(sh, c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) flush_client(sh, c);
+            // EPOLLRDHUP still has to drain pending data; recv() returns 0 at the end
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) read_client(sh, c);
+        }
+        settle(sh);
+        loop_done(sh);
     } // end while
 
-    close(listener);
+    return NULL;
+}
+
+void *shard_loop(void *arg) {
+    struct shard *sh = arg;
+    return sh->ur != NULL ? uring_loop(sh) : epoll_loop(sh);
+}
+
+// Create a shard's listener, event engine and mailbox.
+int shard_init(struct shard *sh, int index, const char *port) {
+    memset(sh, 0, sizeof *sh);
+    sh->index = index;
+    hdr_init(&sh->stats.fanout_ns);
+    hdr_init(&sh->stats.loop_ns);
+    if (log_rate > 0 && (sh->log.buf = malloc(LOG_RING)) == NULL) {
+        perror("Failed to allocate log ring");
+        return -1;
+    }
+    sh->listener = setup_listen(port, nthreads > 1);
+    if (sh->listener < 0) return -1;
+    if (mbox_init(&sh->mbox) == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    if (want_uring) {
+        sh->ur = uring_init();
+        if (sh->ur != NULL) return 0;
+        fprintf(stderr, "Shard %d: io_uring unavailable, falling back to epoll\n", index);
+    }
+
+    sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sh->epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = sh->listener;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->listener, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = sh->mbox.evfd;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->mbox.evfd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
     return 0;
 }
 
+// Copy one shard's metrics while the shard keeps updating them.
+void metrics_read(struct metrics *dst, struct metrics *src) {
+    // the counters come first and are all uint64_t
+    const uint64_t *from = &src->accepted;
+    uint64_t *to = &dst->accepted;
+    for (size_t i = 0; i < offsetof(struct metrics, fanout_ns) / sizeof(uint64_t); ++i) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    hdr_snapshot(&dst->fanout_ns, &src->fanout_ns);
+    hdr_snapshot(&dst->loop_ns, &src->loop_ns);
+}
+
+void metrics_add(struct metrics *sum, const struct metrics *m) {
+    const uint64_t *from = &m->accepted;
+    uint64_t *to = &sum->accepted;
+    for (size_t i = 0; i < offsetof(struct metrics, fanout_ns) / sizeof(uint64_t); ++i) to[i] += from[i];
+    // the peak is per client, so the total is the largest of the shards'
+    sum->queue_peak -= m->queue_peak;
+    if (m->queue_peak > sum->queue_peak) sum->queue_peak = m->queue_peak;
+    hdr_merge(&sum->fanout_ns, &m->fanout_ns);
+    hdr_merge(&sum->loop_ns, &m->loop_ns);
+}
+
+// Snapshot every shard into per[] and their sum into *total.
+void metrics_collect(struct metrics *per, struct metrics *total) {
+    memset(total, 0, offsetof(struct metrics, fanout_ns));
+    hdr_init(&total->fanout_ns);
+    hdr_init(&total->loop_ns);
+    for (int i = 0; i < nthreads; ++i) {
+        metrics_read(&per[i], &shards[i].stats);
+        metrics_add(total, &per[i]);
+    }
+}
+
+void metrics_json(FILE *out, const struct metrics *m, uint64_t log_dropped) {
+    fprintf(out, "{\"clients\": %llu, \"accepted\": %llu, \"closed\": %llu, \"lines_in\": %llu, \"bytes_in\": %llu, "
+            "\"msgs_out\": %llu, \"bytes_out\": %llu, \"dropped\": %llu, \"evicted\": %llu, \"queued_bytes\": %llu, "
+            "\"queue_peak_bytes\": %llu, \"loops\": %llu, \"log_dropped\": %llu, \"fanout_us\": ",
+            (unsigned long long)(m->accepted - m->closed), (unsigned long long)m->accepted,
+            (unsigned long long)m->closed, (unsigned long long)m->lines_in, (unsigned long long)m->bytes_in,
+            (unsigned long long)m->msgs_out, (unsigned long long)m->bytes_out, (unsigned long long)m->dropped,
+            (unsigned long long)m->evicted, (unsigned long long)m->queued, (unsigned long long)m->queue_peak,
+            (unsigned long long)m->loops, (unsigned long long)log_dropped);
+    hdr_print_json(&m->fanout_ns, out, 1000.0);
+    fprintf(out, ", \"loop_us\": ");
+    hdr_print_json(&m->loop_ns, out, 1000.0);
+    fprintf(out, "}");
+}
+
+// Answer one admin connection with a JSON snapshot and hang up.
+void serve_admin(int adminfd, struct metrics *per, struct metrics *total, uint64_t started) {
+    int fd = accept4(adminfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) return;
+    char *json;
+    size_t len;
+    FILE *out = open_memstream(&json, &len);
+    if (out == NULL) {
+        close(fd);
+        return;
+    }
+    metrics_collect(per, total);
+    uint64_t log_dropped = 0;
+    for (int i = 0; i < nthreads; ++i) log_dropped += __atomic_load_n(&shards[i].log.dropped, __ATOMIC_RELAXED);
+    fprintf(out, "{\"uptime_s\": %.3f, \"threads\": %d, \"engine\": \"%s\", \"total\": ",
+            (now_ns() - started) / 1e9, nthreads, shards[0].ur != NULL ? "io_uring" : "epoll");
+    metrics_json(out, total, log_dropped);
+    fprintf(out, ", \"shards\": [");
+    for (int i = 0; i < nthreads; ++i) {
+        if (i > 0) fprintf(out, ", ");
+        metrics_json(out, &per[i], __atomic_load_n(&shards[i].log.dropped, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+
+    // a peer that never reads must not stall the monitor for long
+    struct timeval tv = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = send(fd, json + off, len - off, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        off += n;
+    }
+    free(json);
+    close(fd);
+}
+
+// One line of rates since the previous dump, plus latency percentiles since start.
+void dump_stats(struct metrics *per, struct metrics *total, struct metrics *prev, double secs) {
+    metrics_collect(per, total);
+    fprintf(stderr, "stats: %llu clients, +%llu -%llu, in %.0f lines/s %.2f MB/s, out %.0f msgs/s %.2f MB/s, "
+            "queued %llu B (peak %llu), dropped %llu, evicted %llu | fanout p50 %.1f p99 %.1f us"
+            " | loop p50 %.1f p99 %.1f max %.1f us\n",
+            (unsigned long long)(total->accepted - total->closed),
+            (unsigned long long)(total->accepted - prev->accepted), (unsigned long long)(total->closed - prev->closed),
+            (total->lines_in - prev->lines_in) / secs, (total->bytes_in - prev->bytes_in) / secs / 1e6,
+            (total->msgs_out - prev->msgs_out) / secs, (total->bytes_out - prev->bytes_out) / secs / 1e6,
+            (unsigned long long)total->queued, (unsigned long long)total->queue_peak,
+            (unsigned long long)(total->dropped - prev->dropped), (unsigned long long)(total->evicted - prev->evicted),
+            hdr_percentile(&total->fanout_ns, 50) / 1e3, hdr_percentile(&total->fanout_ns, 99) / 1e3,
+            hdr_percentile(&total->loop_ns, 50) / 1e3, hdr_percentile(&total->loop_ns, 99) / 1e3,
+            total->loop_ns.count ? total->loop_ns.max / 1e3 : 0.0);
+    memcpy(prev, total, offsetof(struct metrics, fanout_ns));
+}
+
+// Print whatever the shards have logged since the last tick.
+void drain_logs(uint64_t *reported) {
+    int wrote = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        struct logring *lr = &shards[i].log;
+        if (lr->buf == NULL) continue;
+        uint64_t head = lr->head;
+        uint64_t tail = __atomic_load_n(&lr->tail, __ATOMIC_ACQUIRE);
+        while (head < tail) {
+            size_t pos = head & (LOG_RING - 1);
+            size_t n = tail - head < LOG_RING - pos ? tail - head : LOG_RING - pos;
+            fwrite(lr->buf + pos, 1, n, stdout);
+            head += n;
+            wrote = 1;
+        }
+        __atomic_store_n(&lr->head, head, __ATOMIC_RELEASE);
+        uint64_t dropped = __atomic_load_n(&lr->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported[i]) {
+            printf("[%llu lines not logged]\n", (unsigned long long)(dropped - reported[i]));
+            reported[i] = dropped;
+            wrote = 1;
+        }
+    }
+    if (wrote) fflush(stdout);
+}
+
+// The monitor thread: drains the log rings, serves the admin socket and
+// prints periodic stats, so none of it runs on a shard.
+void *monitor_loop(void *arg) {
+    int adminfd = (int)(intptr_t)arg;
+    struct metrics *per = malloc(nthreads * sizeof *per);
+    struct metrics *total = malloc(sizeof *total);
+    struct metrics *prev = calloc(1, sizeof *prev);
+    uint64_t *reported = calloc(nthreads, sizeof *reported);
+    if (per == NULL || total == NULL || prev == NULL || reported == NULL) {
+        perror("monitor");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t started = now_ns();
+    uint64_t last_dump = started;
+    while (1) {
+        struct pollfd pfd = { .fd = adminfd, .events = POLLIN };
+        int n = poll(&pfd, adminfd >= 0, MONITOR_TICK_MS);
+        if (n > 0 && (pfd.revents & POLLIN)) serve_admin(adminfd, per, total, started);
+        drain_logs(reported);
+        uint64_t now = now_ns();
+        if (stats_interval > 0 && now - last_dump >= (uint64_t)stats_interval * 1000000000ull) {
+            dump_stats(per, total, prev, (now - last_dump) / 1e9);
+            last_dump = now;
+        }
+    }
+    return NULL;
+}
+
+int setup_admin(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Admin socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 16) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--threads N] [-E epoll|io_uring] [-q high_water_bytes] [-P drop|disconnect] [-z zerocopy_bytes]\n"
+                    "       [-H history_lines] [-L history_log] [-l log_lines_per_sec] [-S stats_secs]\n"
+                    "       [-A admin_socket] [port]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "engine", required_argument, NULL, 'E' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *log_path = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:E:q:P:z:H:L:l:S:A:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > MAX_THREADS) usage(argv[0]);
+            break;
+        case 'E':
+            if (strcmp(optarg, "epoll") == 0) want_uring = 0;
+            else if (strcmp(optarg, "io_uring") == 0 || strcmp(optarg, "uring") == 0) want_uring = 1;
+            else usage(argv[0]);
+            break;
+        case 'q':
+            high_water = strtoul(optarg, NULL, 10);
+            if (high_water == 0) usage(argv[0]);
+            break;
+        case 'P':
+            if (strcmp(optarg, "drop") == 0) slow_policy = POLICY_DROP_OLDEST;
+            else if (strcmp(optarg, "disconnect") == 0) slow_policy = POLICY_DISCONNECT;
+            else usage(argv[0]);
+            break;
+        case 'z':
+            zerocopy_min = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            history_lines = atoi(optarg);
+            if (history_lines < 0 || history_lines > HISTORY_MAX_LINES) usage(argv[0]);
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'l':
+            log_rate = atoi(optarg);
+            if (log_rate < 0) usage(argv[0]);
+            break;
+        case 'S':
+            stats_interval = atoi(optarg);
+            if (stats_interval < 0) usage(argv[0]);
+            break;
+        case 'A':
+            admin_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    const char *port = (optind < argc) ? argv[optind] : DEFAULT_PORT;
+    raise_fd_limit();
+    hist_init();
+    if (log_path != NULL) {
+        if (history_lines == 0) usage(argv[0]);
+        if (log_open(log_path) == -1) exit(EXIT_FAILURE);
+    }
+
+    // all shards must exist before any thread can post to another's mailbox
+    shards = calloc(nthreads, sizeof *shards);
+    if (shards == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        if (shard_init(&shards[i], i, port) == -1) exit(EXIT_FAILURE);
+    }
+
+    printf("Listening on port %s with %d thread%s (%s)\n", port, nthreads, nthreads == 1 ? "" : "s",
+           shards[0].ur != NULL ? "io_uring" : "epoll");
+    fflush(stdout);
+
+    if (log_rate > 0 || stats_interval > 0 || admin_path != NULL) {
+        int adminfd = -1;
+        if (admin_path != NULL && (adminfd = setup_admin(admin_path)) == -1) exit(EXIT_FAILURE);
+        pthread_t monitor;
+        int rc = pthread_create(&monitor, NULL, monitor_loop, (void *)(intptr_t)adminfd);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 1; i < nthreads; ++i) {
+        int rc = pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    shard_loop(&shards[0]);
+    return 0;
+}
@@ -1,32 +1,306 @@
+// client.c
+// Request/response client for server.c
+// Compile: gcc -Wall -O2 -pthread -o client client.c
+// Run: ./client
+//      ./client -b [-t threads] [-c conns] [-p depth] [-l bytes] [-d secs] [-W warmup_secs] [-j] [host] [port]
+//
+// Without -b, sends one line read from stdin to 127.0.0.1:8080 and prints the reply.
+//
+// -b benchmarks the server instead. conns persistent connections are spread
+// over threads, each thread running its own epoll loop. Every connection
+// keeps depth requests of the given size in flight: as each response line
+// comes back its latency is recorded and another request is sent, with all
+// requests for one read going out in a single send(). After a warmup it
+// reports requests/sec, bytes/sec and latency percentiles as text, or as
+// JSON with -j.
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include "hdr-hist.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define RECV_SIZE 65536
+#define MAX_EVENTS 256
+#define MAX_DEPTH 4096
+#define MAX_PAYLOAD 65536
+
+// One benchmark connection. Requests are all alike, so what is left to send
+// is a byte count into the shared request buffer.
+struct bconn {
+    int fd;
+    size_t unsent;          // request bytes not yet accepted by the socket
+    size_t phase;           // offset into the request of the next unsent byte
+    uint64_t *sent_at;      // ring of send times of the requests in flight
+    int head, inflight;
+};
+
+struct bthread {
+    pthread_t thread;
+    struct bconn *conns;
+    int nconns;
+    uint64_t requests, bytes_out, bytes_in;
+    int failed;
+    struct hdr_hist lat;
+};
+
+static struct sockaddr_in serv_addr;
+static int depth = 1;
+static size_t payload = 16;
+static char *requests;          // the request repeated MAX_DEPTH times
+static uint64_t t_start, t_end;
+static int stop;                // set by a thread whose connection failed
 
-int main() {
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Queue n more requests on a connection and push out what the socket takes.
+int send_requests(struct bconn *c, int n, uint64_t now) {
+    for (int i = 0; i < n; ++i) {
+        c->sent_at[(c->head + c->inflight) % depth] = now;
+        c->inflight++;
+    }
+    c->unsent += (size_t)n * payload;
+    while (c->unsent > 0) {
+        size_t len = (size_t)MAX_DEPTH * payload - c->phase;
+        if (len > c->unsent) len = c->unsent;
+        ssize_t sent = send(c->fd, requests + c->phase, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->unsent -= sent;
+        c->phase = (c->phase + sent) % payload;
+    }
+    return 0;
+}
+
+// Retire every response that has arrived and replace each with a new request.
+int read_responses(struct bthread *t, struct bconn *c, char *buffer) {
+    while (1) {
+        ssize_t n = recv(c->fd, buffer, RECV_SIZE, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        uint64_t now = now_ns();
+        int done = 0;
+        for (const char *p = buffer; (p = memchr(p, '\n', buffer + n - p)) != NULL; ++p) {
+            if (c->inflight == 0) return -1;    // more answers than questions
+            uint64_t sent = c->sent_at[c->head];
+            c->head = (c->head + 1) % depth;
+            c->inflight--;
+            done++;
+            if (sent >= t_start && now < t_end) {
+                t->requests++;
+                hdr_record(&t->lat, now - sent);
+            }
+        }
+        if (now >= t_start && now < t_end) {
+            t->bytes_in += n;
+            t->bytes_out += (size_t)done * payload;
+        }
+        if (now < t_end && done > 0 && send_requests(c, done, now) == -1) return -1;
+    }
+}
+
+void *bench_thread(void *arg) {
+    struct bthread *t = arg;
+    char *buffer = malloc(RECV_SIZE);
+    int epfd = epoll_create1(0);
+    if (buffer == NULL || epfd == -1) {
+        perror("bench thread");
+        t->failed = 1;
+        return NULL;
+    }
+
+    for (int i = 0; i < t->nconns; ++i) {
+        struct bconn *c = &t->conns[i];
+        c->sent_at = malloc(depth * sizeof *c->sent_at);
+        if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || c->sent_at == NULL ||
+            connect(c->fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+            perror("Connection Failed");
+            t->failed = 1;
+            return NULL;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        fcntl(c->fd, F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        if (send_requests(c, depth, now_ns()) == -1) {
+            perror("send");
+            t->failed = 1;
+            return NULL;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && now_ns() < t_end) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; ++i) {
+            struct bconn *c = events[i].data.ptr;
+            int rc = 0;
+            if (events[i].events & EPOLLOUT) rc = send_requests(c, 0, 0);
+            if (rc == 0 && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) rc = read_responses(t, c, buffer);
+            if (rc == -1) {
+                fprintf(stderr, "Connection lost\n");
+                t->failed = 1;
+                __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    for (int i = 0; i < t->nconns; ++i) {
+        close(t->conns[i].fd);
+        free(t->conns[i].sent_at);
+    }
+    close(epfd);
+    free(buffer);
+    return NULL;
+}
+
+int bench(int nthreads, int nconns, double duration, double warmup, int json) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // every request is payload - 1 filler bytes and a newline
+    requests = malloc((size_t)MAX_DEPTH * payload);
+    struct bthread *threads = calloc(nthreads, sizeof *threads);
+    struct bconn *conns = calloc(nconns, sizeof *conns);
+    if (requests == NULL || threads == NULL || conns == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memset(requests, 'x', (size_t)MAX_DEPTH * payload);
+    for (int i = 1; i <= MAX_DEPTH; ++i) requests[(size_t)i * payload - 1] = '\n';
+
+    t_start = now_ns() + (uint64_t)(warmup * 1e9);
+    t_end = t_start + (uint64_t)(duration * 1e9);
+    for (int i = 0, first = 0; i < nthreads; ++i) {
+        struct bthread *t = &threads[i];
+        t->conns = conns + first;
+        t->nconns = nconns / nthreads + (i < nconns % nthreads);
+        first += t->nconns;
+        hdr_init(&t->lat);
+        if (pthread_create(&t->thread, NULL, bench_thread, t) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    struct hdr_hist *lat = malloc(sizeof *lat);
+    if (lat == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    hdr_init(lat);
+    uint64_t reqs = 0, bytes_out = 0, bytes_in = 0;
+    int failed = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        reqs += threads[i].requests;
+        bytes_out += threads[i].bytes_out;
+        bytes_in += threads[i].bytes_in;
+        failed |= threads[i].failed;
+        hdr_merge(lat, &threads[i].lat);
+    }
+    if (failed) return -1;
+
+    if (json) {
+        printf("{\"threads\": %d, \"connections\": %d, \"depth\": %d, \"payload_bytes\": %zu, \"duration_s\": %g, "
+               "\"warmup_s\": %g, \"requests\": %llu, \"requests_per_s\": %.1f, \"bytes_out_per_s\": %.1f, "
+               "\"bytes_in_per_s\": %.1f, \"latency_us\": ",
+               nthreads, nconns, depth, payload, duration, warmup, (unsigned long long)reqs,
+               reqs / duration, bytes_out / duration, bytes_in / duration);
+        hdr_print_json(lat, stdout, 1000.0);
+        printf("}\n");
+    } else {
+        printf("%d threads, %d connections, depth %d, %zu byte requests, %g s after %g s warmup\n",
+               nthreads, nconns, depth, payload, duration, warmup);
+        printf("requests  %12llu  %12.1f req/s\n", (unsigned long long)reqs, reqs / duration);
+        printf("bytes out %12.2f MB/s  in %.2f MB/s\n", bytes_out / duration / 1e6, bytes_in / duration / 1e6);
+        printf("latency:\n");
+        hdr_print(lat, stdout, 1000.0, "us");
+    }
+    free(lat);
+    free(conns);
+    free(threads);
+    free(requests);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s\n"
+                    "       %s -b [-t threads] [-c conns] [-p depth] [-l bytes] [-d secs] [-W warmup_secs] [-j] [host] [port]\n",
+            prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
     int sock = 0;
-    struct sockaddr_in serv_addr;
     char buffer[BUFFER_SIZE] = {0};
+    int benchmark = 0, nthreads = 1, nconns = 0, json = 0;
+    double duration = 10, warmup = 1;
+    int opt;
 
-    // Create socket file descriptor
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        exit(EXIT_FAILURE);
+    while ((opt = getopt(argc, argv, "bt:c:p:l:d:W:jh")) != -1) {
+        switch (opt) {
+        case 'b': benchmark = 1; break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'l': payload = strtoul(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'W': warmup = atof(optarg); break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nconns == 0) nconns = nthreads;
+    if (nthreads < 1 || nconns < nthreads || depth < 1 || depth > MAX_DEPTH || payload < 1 ||
+        payload > MAX_PAYLOAD || duration <= 0 || warmup < 0) {
+        usage(argv[0]);
     }
 
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+    serv_addr.sin_port = htons(optind + 1 < argc ? atoi(argv[optind + 1]) : PORT);
 
     // Convert IPv4 and IPv6 addresses from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, optind < argc ? argv[optind] : "127.0.0.1", &serv_addr.sin_addr) <= 0) {
         perror("Invalid address/ Address not supported");
         exit(EXIT_FAILURE);
     }
 
+    if (benchmark) return bench(nthreads, nconns, duration, warmup, json) == -1 ? EXIT_FAILURE : 0;
+
+    // Create socket file descriptor
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Socket creation error");
+        exit(EXIT_FAILURE);
+    }
+
     // Connect to the server
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         perror("Connection Failed");
@@ -34,7 +308,6 @@ int main() {
     }
 
     // Send data to the server
-    const char *message = "Hello from client";
     char name[256];
 
     printf("Enter your message:");
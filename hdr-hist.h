@@ -0,0 +1,154 @@
+// hdr-hist.h
+// Log-linear latency histogram in the style of HdrHistogram, header only.
+// Values are unsigned 64-bit (nanoseconds by convention). Every power-of-two
+// range is split into HDR_SUB linear sub-buckets, so any recorded value is
+// reported within 1/HDR_SUB (under 1%) of its true value, with a fixed
+// 60 KiB of counters and O(1) recording.
+//
+// Usage:
+//   struct hdr_hist h;
+//   hdr_init(&h);
+//   hdr_record(&h, latency_ns);
+//   hdr_print(&h, stdout, 1000.0, "us");
+//   hdr_print_json(&h, stdout, 1000.0);
+
+#ifndef HDR_HIST_H
+#define HDR_HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HDR_SUB_BITS 7
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS ((64 - HDR_SUB_BITS + 1) * HDR_SUB)
+
+struct hdr_hist {
+    uint64_t count;
+    uint64_t min, max;
+    double sum;
+    uint64_t counts[HDR_BUCKETS];
+};
+
+static inline void hdr_init(struct hdr_hist *h) {
+    memset(h, 0, sizeof *h);
+    h->min = UINT64_MAX;
+}
+
+// Values below 2 * HDR_SUB map to themselves; above that, the top
+// HDR_SUB_BITS + 1 significant bits pick the bucket.
+static inline int hdr_index(uint64_t v) {
+    if (v < 2 * HDR_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HDR_SUB_BITS;
+    return (shift + 1) * HDR_SUB + (int)(v >> shift) - HDR_SUB;
+}
+
+// Smallest value that lands in bucket i.
+static inline uint64_t hdr_value(int i) {
+    if (i < 2 * HDR_SUB) return (uint64_t)i;
+    int shift = i / HDR_SUB - 1;
+    return (uint64_t)(i - shift * HDR_SUB) << shift;
+}
+
+static inline void hdr_record_n(struct hdr_hist *h, uint64_t v, uint64_t n) {
+    h->counts[hdr_index(v)] += n;
+    h->count += n;
+    h->sum += (double)v * n;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static inline void hdr_record(struct hdr_hist *h, uint64_t v) {
+    hdr_record_n(h, v, 1);
+}
+
+// Recording for a histogram owned by one thread and read by others through
+// hdr_snapshot(). Fields are written with relaxed atomic stores, which cost
+// the writer nothing over plain ones; a snapshot may be a few samples behind
+// but never sees a torn value.
+static inline void hdr_record_shared(struct hdr_hist *h, uint64_t v) {
+    uint64_t *bucket = &h->counts[hdr_index(v)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    double sum = h->sum + v;
+    __atomic_store(&h->sum, &sum, __ATOMIC_RELAXED);
+    if (v < h->min) __atomic_store_n(&h->min, v, __ATOMIC_RELAXED);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_snapshot(struct hdr_hist *dst, const struct hdr_hist *src) {
+    for (int i = 0; i < HDR_BUCKETS; ++i) dst->counts[i] = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    __atomic_load(&src->sum, &dst->sum, __ATOMIC_RELAXED);
+    dst->min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+// Fold src into dst, e.g. to combine per-thread histograms.
+static inline void hdr_merge(struct hdr_hist *dst, const struct hdr_hist *src) {
+    for (int i = 0; i < HDR_BUCKETS; ++i) dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+static inline double hdr_mean(const struct hdr_hist *h) {
+    return h->count ? h->sum / h->count : 0.0;
+}
+
+// Value at percentile p (0-100): the highest value of the bucket holding
+// that rank, clamped to the recorded range.
+static inline uint64_t hdr_percentile(const struct hdr_hist *h, double p) {
+    if (h->count == 0) return 0;
+    if (p >= 100.0) return h->max;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HDR_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = i + 1 < HDR_BUCKETS ? hdr_value(i + 1) - 1 : h->max;
+            if (v > h->max) v = h->max;
+            if (v < h->min) v = h->min;
+            return v;
+        }
+    }
+    return h->max;
+}
+
+static const double hdr_report_pcts[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+#define HDR_NREPORT (int)(sizeof hdr_report_pcts / sizeof hdr_report_pcts[0])
+
+// Human-readable summary; values are divided by scale and labelled unit.
+static inline void hdr_print(const struct hdr_hist *h, FILE *out, double scale, const char *unit) {
+    if (h->count == 0) {
+        fprintf(out, "  no samples\n");
+        return;
+    }
+    fprintf(out, "  samples %llu  min %.1f  mean %.1f  max %.1f %s\n", (unsigned long long)h->count,
+            h->min / scale, hdr_mean(h) / scale, h->max / scale, unit);
+    for (int i = 0; i < HDR_NREPORT; ++i) {
+        fprintf(out, "  p%-7g %12.1f %s\n", hdr_report_pcts[i], hdr_percentile(h, hdr_report_pcts[i]) / scale, unit);
+    }
+}
+
+// The same summary as a JSON object, followed by the non-empty buckets as
+// [lowest value, count] pairs so runs can be re-plotted or merged later.
+static inline void hdr_print_json(const struct hdr_hist *h, FILE *out, double scale) {
+    fprintf(out, "{\"samples\": %llu, \"min\": %.3f, \"mean\": %.3f, \"max\": %.3f",
+            (unsigned long long)h->count, h->count ? h->min / scale : 0.0, hdr_mean(h) / scale, h->max / scale);
+    for (int i = 0; i < HDR_NREPORT; ++i) {
+        fprintf(out, ", \"p%g\": %.3f", hdr_report_pcts[i], hdr_percentile(h, hdr_report_pcts[i]) / scale);
+    }
+    fprintf(out, ", \"buckets\": [");
+    const char *sep = "";
+    for (int i = 0; i < HDR_BUCKETS; ++i) {
+        if (h->counts[i] == 0) continue;
+        fprintf(out, "%s[%.3f, %llu]", sep, hdr_value(i) / scale, (unsigned long long)h->counts[i]);
+        sep = ", ";
+    }
+    fprintf(out, "]}");
+}
+
+#endif
@@ -1,49 +1,887 @@
+// memory-tester.c
+// Controlled memory-pressure ramp with RSS, fault and latency telemetry
+// Compile: gcc -Wall -O2 -pthread -o memory-tester memory-tester.c
+// Run: ./memory-tester [-c chunk_MB] [-r chunks_per_sec] [-m limit_MB|percent%] [-n] [-P] [-f csv|json] [-o file]
+//      ./memory-tester -B [-s min[:max]] [-T threads,...] [-k kernels] [-I avx2|sse2|scalar] [-H] [-b bytes]
+//                      [-P] [-f csv|json] [-o file]
+//
+// Allocates chunk_MB chunks (10 MB by default) at a fixed rate (1000/s by
+// default; 0 means as fast as possible) and writes one byte per page of
+// each, so the memory is really resident rather than merely overcommitted
+// (-n skips the touching, as the tester originally did). The ramp stops
+// cleanly at the limit: an absolute size in MB, or a percentage of the
+// memory budget, which is MemAvailable or the headroom left under this
+// process's cgroup memory limit, whichever is smaller (default 90%). It
+// also stops if an allocation fails or on SIGINT/SIGTERM.
+//
+// Every step is sampled: elapsed time, total allocated, RSS, minor and
+// major faults taken during the step, the malloc and touch latency,
+// MemAvailable, cgroup usage and the memory PSI "some avg10" where the
+// kernel provides them. The time series goes to stdout or -o as CSV or
+// JSON; progress and the summary go to stderr.
+//
+// -B measures memory speed instead. The kernels are sequential read, write
+// and copy, a STREAM-style triad (a = b + 3c), and a dependent random
+// pointer chase over 64-byte lines for latency. The bandwidth kernels use
+// AVX2 or SSE2, picked at runtime from what the CPU supports (-I forces one).
+// Each runs for every working-set size from min to max (16K:256M by
+// default, stepping by 4x, per thread) at each thread count (-T, default
+// 1, 2, 4, ... up to the CPU count), with threads pinned to CPUs and each
+// owning its own first-touched buffers. The result is a table of GB/s and
+// ns per access, or CSV/JSON with -f. -H asks for transparent huge pages,
+// -b sets the bytes moved per bandwidth measurement (default 1G), and -k
+// picks kernels from read,write,copy,triad,chase.
+//
+// -P adds hardware counters (perf-counters.h) to either mode: for each ramp
+// step, and for the best trial of each benchmark, summed over its threads.
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "perf-counters.h"
 
 #define CHUNK_SIZE (10 * 1024 * 1024) // 10 Megabytes per chunk
+#define MB (1024.0 * 1024.0)
+#define DEFAULT_PERCENT 90.0
+#define NO_LIMIT (1ULL << 60)   // cgroup limits at or above this mean unlimited
+
+// One step of the ramp.
+struct sample {
+    double t;               // seconds since the start
+    size_t step;
+    size_t total;           // bytes allocated so far
+    size_t rss;
+    long minflt, majflt;    // faults during this step
+    double alloc_us, touch_us;
+    long long avail;        // MemAvailable, -1 if unknown
+    long long cg_usage;     // cgroup memory usage, -1 if unknown
+    double psi_some10;      // memory PSI some avg10, -1 if unknown
+    const struct perf_counters *perf;   // counters for the step, NULL without -P
+};
+
+static volatile sig_atomic_t stop;
+
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t current_rss(void) {
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+long long mem_available(void) {
+    char line[128];
+    long long kb = -1;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+double psi_some_avg10(void) {
+    double avg10 = -1;
+    FILE *f = fopen("/proc/pressure/memory", "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "some avg10=%lf", &avg10) != 1) avg10 = -1;
+    fclose(f);
+    return avg10;
+}
+
+long long read_number(const char *path) {
+    char buf[64];
+    long long value = -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    if (fgets(buf, sizeof buf, f) != NULL) {
+        if (strncmp(buf, "max", 3) == 0) value = NO_LIMIT;
+        else value = strtoll(buf, NULL, 10);
+    }
+    fclose(f);
+    return value;
+}
+
+// Files holding this process's cgroup memory limit and usage, for cgroup v2
+// or the v1 memory controller. Inside a cgroup namespace the group is
+// usually mounted at the root, so that is tried after the full path.
+char cg_limit_path[512], cg_usage_path[512];
+
+void find_cgroup(void) {
+    char line[512], limit_path[512], usage_path[512];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) return;
+    while (fgets(line, sizeof line, f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        const char *base, *limit, *usage;
+        char *path = strrchr(line, ':');
+        if (path == NULL) continue;
+        if (strncmp(line, "0::", 3) == 0) {
+            base = "/sys/fs/cgroup";
+            limit = "memory.max";
+            usage = "memory.current";
+        } else if (strstr(line, ":memory:") != NULL) {
+            base = "/sys/fs/cgroup/memory";
+            limit = "memory.limit_in_bytes";
+            usage = "memory.usage_in_bytes";
+        } else {
+            continue;
+        }
+        path++;
+        for (int root = 0; root < 2; ++root) {
+            snprintf(limit_path, sizeof limit_path, "%s%s/%s", base, root ? "" : path, limit);
+            snprintf(usage_path, sizeof usage_path, "%s%s/%s", base, root ? "" : path, usage);
+            if (read_number(usage_path) < 0) continue;
+            // keep the first group found, but prefer one with a real limit
+            int limited = read_number(limit_path) < (long long)NO_LIMIT;
+            if (cg_usage_path[0] == '\0' || limited) {
+                strcpy(cg_limit_path, limit_path);
+                strcpy(cg_usage_path, usage_path);
+            }
+            if (limited) {
+                fclose(f);
+                return;
+            }
+        }
+    }
+    fclose(f);
+}
+
+void write_sample(FILE *out, int json, const struct sample *s) {
+    double avail_mb = s->avail < 0 ? -1 : s->avail / MB;
+    double cg_mb = s->cg_usage < 0 ? -1 : s->cg_usage / MB;
+
+    if (json) {
+        fprintf(out, "%s    {\"t\": %.6f, \"step\": %zu, \"total_mb\": %.1f, \"rss_mb\": %.1f, \"minflt\": %ld, "
+                "\"majflt\": %ld, \"alloc_us\": %.1f, \"touch_us\": %.1f, \"avail_mb\": %.1f, \"cgroup_mb\": %.1f, "
+                "\"psi_some10\": %.2f",
+                s->step > 1 ? ",\n" : "", s->t, s->step, s->total / MB, s->rss / MB, s->minflt, s->majflt,
+                s->alloc_us, s->touch_us, avail_mb, cg_mb, s->psi_some10);
+        if (s->perf != NULL) {
+            fprintf(out, ", \"counters\": ");
+            perf_print_json(s->perf, out);
+        }
+        fprintf(out, "}");
+    } else {
+        fprintf(out, "%.6f,%zu,%.1f,%.1f,%ld,%ld,%.1f,%.1f,%.1f,%.1f,%.2f", s->t, s->step, s->total / MB,
+                s->rss / MB, s->minflt, s->majflt, s->alloc_us, s->touch_us, avail_mb, cg_mb,
+                s->psi_some10);
+        if (s->perf != NULL) perf_print_csv(s->perf, out);
+        fprintf(out, "\n");
+    }
+}
+
+// ---- Bandwidth and latency benchmarks (-B) ----
+
+#define MAX_BENCH_THREADS 256
+#define MAX_SIZES 64
+#define TRIALS 3                // best of, as STREAM reports
+#define LINE 64                 // bytes per pointer-chase node
+#define CHASE_STEPS (1L << 22)
+#define TRIAD_SCALAR 3.0
+
+enum kernel { K_READ, K_WRITE, K_COPY, K_TRIAD, K_CHASE, NUM_KERNELS };
+
+const char *kernel_names[NUM_KERNELS] = { "read", "write", "copy", "triad", "chase" };
+const int kernel_arrays[NUM_KERNELS] = { 1, 1, 2, 3, 1 };
+
+// A bandwidth kernel runs over n doubles (a multiple of 16) of up to three
+// arrays and returns something derived from its work so nothing is elided.
+typedef double (*bw_fn)(double *a, const double *b, const double *c, size_t n);
+
+struct isa {
+    const char *name;
+    bw_fn fn[K_CHASE];
+};
+
+double read_scalar(double *a, const double *b, const double *c, size_t n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; i += 4) {
+        s0 += a[i];
+        s1 += a[i + 1];
+        s2 += a[i + 2];
+        s3 += a[i + 3];
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+double write_scalar(double *a, const double *b, const double *c, size_t n) {
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; ++i) a[i] = 1.0;
+    return a[n - 1];
+}
+
+double copy_scalar(double *a, const double *b, const double *c, size_t n) {
+    (void)c;
+    for (size_t i = 0; i < n; ++i) a[i] = b[i];
+    return a[n - 1];
+}
+
+double triad_scalar(double *a, const double *b, const double *c, size_t n) {
+    for (size_t i = 0; i < n; ++i) a[i] = b[i] + TRIAD_SCALAR * c[i];
+    return a[n - 1];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) double read_sse2(double *a, const double *b, const double *c, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; i += 8) {
+        s0 = _mm_add_pd(s0, _mm_load_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_load_pd(a + i + 2));
+        s2 = _mm_add_pd(s2, _mm_load_pd(a + i + 4));
+        s3 = _mm_add_pd(s3, _mm_load_pd(a + i + 6));
+    }
+    double out[2];
+    _mm_storeu_pd(out, _mm_add_pd(_mm_add_pd(s0, s1), _mm_add_pd(s2, s3)));
+    return out[0] + out[1];
+}
+
+__attribute__((target("sse2"))) double write_sse2(double *a, const double *b, const double *c, size_t n) {
+    __m128d v = _mm_set1_pd(1.0);
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; i += 8) {
+        _mm_store_pd(a + i, v);
+        _mm_store_pd(a + i + 2, v);
+        _mm_store_pd(a + i + 4, v);
+        _mm_store_pd(a + i + 6, v);
+    }
+    return a[n - 1];
+}
+
+__attribute__((target("sse2"))) double copy_sse2(double *a, const double *b, const double *c, size_t n) {
+    (void)c;
+    for (size_t i = 0; i < n; i += 8) {
+        _mm_store_pd(a + i, _mm_load_pd(b + i));
+        _mm_store_pd(a + i + 2, _mm_load_pd(b + i + 2));
+        _mm_store_pd(a + i + 4, _mm_load_pd(b + i + 4));
+        _mm_store_pd(a + i + 6, _mm_load_pd(b + i + 6));
+    }
+    return a[n - 1];
+}
+
+__attribute__((target("sse2"))) double triad_sse2(double *a, const double *b, const double *c, size_t n) {
+    __m128d s = _mm_set1_pd(TRIAD_SCALAR);
+    for (size_t i = 0; i < n; i += 4) {
+        _mm_store_pd(a + i, _mm_add_pd(_mm_load_pd(b + i), _mm_mul_pd(s, _mm_load_pd(c + i))));
+        _mm_store_pd(a + i + 2, _mm_add_pd(_mm_load_pd(b + i + 2), _mm_mul_pd(s, _mm_load_pd(c + i + 2))));
+    }
+    return a[n - 1];
+}
+
+__attribute__((target("avx2"))) double read_avx2(double *a, const double *b, const double *c, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; i += 16) {
+        s0 = _mm256_add_pd(s0, _mm256_load_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_load_pd(a + i + 4));
+        s2 = _mm256_add_pd(s2, _mm256_load_pd(a + i + 8));
+        s3 = _mm256_add_pd(s3, _mm256_load_pd(a + i + 12));
+    }
+    double out[4];
+    _mm256_storeu_pd(out, _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3)));
+    return out[0] + out[1] + out[2] + out[3];
+}
+
+__attribute__((target("avx2"))) double write_avx2(double *a, const double *b, const double *c, size_t n) {
+    __m256d v = _mm256_set1_pd(1.0);
+    (void)b, (void)c;
+    for (size_t i = 0; i < n; i += 16) {
+        _mm256_store_pd(a + i, v);
+        _mm256_store_pd(a + i + 4, v);
+        _mm256_store_pd(a + i + 8, v);
+        _mm256_store_pd(a + i + 12, v);
+    }
+    return a[n - 1];
+}
+
+__attribute__((target("avx2"))) double copy_avx2(double *a, const double *b, const double *c, size_t n) {
+    (void)c;
+    for (size_t i = 0; i < n; i += 16) {
+        _mm256_store_pd(a + i, _mm256_load_pd(b + i));
+        _mm256_store_pd(a + i + 4, _mm256_load_pd(b + i + 4));
+        _mm256_store_pd(a + i + 8, _mm256_load_pd(b + i + 8));
+        _mm256_store_pd(a + i + 12, _mm256_load_pd(b + i + 12));
+    }
+    return a[n - 1];
+}
+
+__attribute__((target("avx2,fma"))) double triad_avx2(double *a, const double *b, const double *c, size_t n) {
+    __m256d s = _mm256_set1_pd(TRIAD_SCALAR);
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_store_pd(a + i, _mm256_fmadd_pd(s, _mm256_load_pd(c + i), _mm256_load_pd(b + i)));
+        _mm256_store_pd(a + i + 4, _mm256_fmadd_pd(s, _mm256_load_pd(c + i + 4), _mm256_load_pd(b + i + 4)));
+    }
+    return a[n - 1];
+}
+#endif
+
+const struct isa isas[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", { read_avx2, write_avx2, copy_avx2, triad_avx2 } },
+    { "sse2", { read_sse2, write_sse2, copy_sse2, triad_sse2 } },
+#endif
+    { "scalar", { read_scalar, write_scalar, copy_scalar, triad_scalar } },
+};
+#define NUM_ISAS (int)(sizeof isas / sizeof isas[0])
+
+int isa_supported(const struct isa *isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(isa->name, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (strcmp(isa->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+struct bench_config {
+    const struct isa *isa;
+    int hugepages;
+    size_t bytes;               // target bytes moved per bandwidth measurement
+    int use_perf;
+};
+
+// One thread's part of a measurement: it allocates and first-touches its
+// own buffers, so they land on its NUMA node, then runs TRIALS timed passes.
+struct bench_job {
+    pthread_t thread;
+    int cpu;
+    int kernel;
+    size_t ws;                  // working set in bytes, across all arrays
+    long reps;                  // passes, or chase steps
+    const struct bench_config *cfg;
+    pthread_barrier_t *barrier;
+    double start[TRIALS], end[TRIALS];  // absolute, so trials span all threads
+    struct perf_counters perf;
+    uint64_t counts[TRIALS][PERF_NUM_COUNTERS];
+    double sink;
+    int failed;
+};
+
+// The i-th CPU this process may run on, wrapping around.
+int nth_allowed_cpu(int i) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0 || CPU_COUNT(&set) == 0) return -1;
+    i %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set) && i-- == 0) return cpu;
+    }
+    return -1;
+}
+
+uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
 
-int main() {
+// Link the LINE-sized nodes of buf into one random cycle (Sattolo's
+// algorithm), so every load depends on the previous one and the hardware
+// prefetchers cannot guess the next line.
+void build_chase(char *buf, size_t nodes) {
+    size_t *perm = malloc(nodes * sizeof *perm);
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    if (perm == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nodes; ++i) perm[i] = i;
+    for (size_t i = nodes - 1; i > 0; --i) {
+        size_t j = xorshift(&rng) % i;
+        size_t t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    for (size_t i = 0; i < nodes; ++i) *(void **)(buf + i * LINE) = buf + perm[i] * LINE;
+    free(perm);
+}
+
+void *chase(void *p, long steps) {
+    void **q = p;
+    for (long s = 0; s < steps; s += 8) {
+        q = *q; q = *q; q = *q; q = *q;
+        q = *q; q = *q; q = *q; q = *q;
+    }
+    return q;
+}
+
+void *bench_worker(void *arg) {
+    struct bench_job *job = arg;
+    int arrays = kernel_arrays[job->kernel];
+    size_t len = job->ws / arrays / 128 * 128;      // bytes per array, whole 16-double blocks
+    char *buf[3] = { NULL, NULL, NULL };
+
+    if (job->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(job->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+    for (int i = 0; i < arrays; ++i) {
+        buf[i] = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf[i] == MAP_FAILED) {
+            buf[i] = NULL;
+            job->failed = 1;
+            continue;
+        }
+        if (job->cfg->hugepages) madvise(buf[i], len, MADV_HUGEPAGE);
+        for (size_t j = 0; j < len / sizeof(double); ++j) ((double *)buf[i])[j] = 1.0;
+    }
+    if (!job->failed && job->kernel == K_CHASE) build_chase(buf[0], len / LINE);
+    if (job->cfg->use_perf) perf_open(&job->perf);
+
+    bw_fn fn = job->kernel == K_CHASE || job->failed ? NULL : job->cfg->isa->fn[job->kernel];
+    size_t n = len / sizeof(double);
+    void *p = buf[0];
+    for (int t = 0; t < TRIALS; ++t) {
+        pthread_barrier_wait(job->barrier);
+        perf_start(&job->perf);
+        double t0 = now_sec();
+        if (job->failed) {
+            // still take part in the barriers
+        } else if (fn == NULL) {
+            p = chase(p, job->reps);
+        } else {
+            for (long r = 0; r < job->reps; ++r) job->sink += fn((double *)buf[0], (double *)buf[1], (double *)buf[2], n);
+        }
+        job->start[t] = t0;
+        job->end[t] = now_sec();
+        perf_stop(&job->perf);
+        memcpy(job->counts[t], job->perf.value, sizeof job->counts[t]);
+    }
+    perf_close(&job->perf);
+    job->sink += (double)(uintptr_t)p;
+    for (int i = 0; i < arrays; ++i) {
+        if (buf[i] != NULL) munmap(buf[i], len);
+    }
+    return NULL;
+}
+
+// Run one kernel at one working-set size on nthreads threads. Returns GB/s
+// for bandwidth kernels and ns per access for the chase, or -1 on failure;
+// with cfg->use_perf the best trial's counters, summed over the threads,
+// go to perf. After a failure perf has no counters available.
+double measure(const struct bench_config *cfg, int kernel, size_t ws, int nthreads, struct perf_counters *perf) {
+    struct bench_job jobs[MAX_BENCH_THREADS];
+    pthread_barrier_t barrier;
+    int arrays = kernel_arrays[kernel];
+    size_t len = ws / arrays / 128 * 128;
+    long reps;
+
+    memset(perf, 0, sizeof *perf);
+    if (len == 0) return -1;
+    if (kernel == K_CHASE) {
+        reps = (long)(len / LINE) * 2;
+        if (reps < CHASE_STEPS) reps = CHASE_STEPS;
+        reps = (reps + 7) & ~7L;      // chase() goes 8 steps at a time
+    } else {
+        reps = (long)(cfg->bytes / (len * arrays));
+        if (reps < 1) reps = 1;
+    }
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        memset(&jobs[i], 0, sizeof jobs[i]);
+        jobs[i].cpu = nth_allowed_cpu(i);
+        jobs[i].kernel = kernel;
+        jobs[i].ws = ws;
+        jobs[i].reps = reps;
+        jobs[i].cfg = cfg;
+        jobs[i].barrier = &barrier;
+        if (pthread_create(&jobs[i].thread, NULL, bench_worker, &jobs[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int failed = 0;
+    double best = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        failed |= jobs[i].failed;
+    }
+    pthread_barrier_destroy(&barrier);
+    if (failed) return -1;
+    // a trial runs from the first thread's start to the last one's end, so
+    // threads that did not really overlap are not counted as parallel;
+    // keep the best trial
+    int best_trial = 0;
+    for (int t = 0; t < TRIALS; ++t) {
+        double first = jobs[0].start[t], last = jobs[0].end[t];
+        for (int i = 1; i < nthreads; ++i) {
+            if (jobs[i].start[t] < first) first = jobs[i].start[t];
+            if (jobs[i].end[t] > last) last = jobs[i].end[t];
+        }
+        if (t == 0 || last - first < best) {
+            best = last - first;
+            best_trial = t;
+        }
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        memcpy(jobs[i].perf.value, jobs[i].counts[best_trial], sizeof jobs[i].perf.value);
+        perf_sum(perf, &jobs[i].perf, i == 0);
+    }
+    if (best <= 0) return -1;
+    if (kernel == K_CHASE) return best * 1e9 / reps;
+    return (double)len * arrays * reps * nthreads / best / 1e9;
+}
+
+// Parse a size such as 16K, 256M or 1G; plain numbers are bytes.
+size_t parse_size(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; break;
+    case 'm': case 'M': v *= 1024 * 1024; break;
+    case 'g': case 'G': v *= 1024 * 1024 * 1024; break;
+    }
+    return v > 0 ? (size_t)v : 0;
+}
+
+void format_size(char *buf, size_t len, size_t bytes) {
+    if (bytes >= (1UL << 30) && bytes % (1UL << 30) == 0) snprintf(buf, len, "%zuG", bytes >> 30);
+    else if (bytes >= (1UL << 20) && bytes % (1UL << 20) == 0) snprintf(buf, len, "%zuM", bytes >> 20);
+    else if (bytes >= 1024 && bytes % 1024 == 0) snprintf(buf, len, "%zuK", bytes >> 10);
+    else snprintf(buf, len, "%zu", bytes);
+}
+
+enum format { FMT_TABLE, FMT_CSV, FMT_JSON };
+
+// Every kernel at every working-set size (min, 4x min, ... up to max) and
+// thread count, as a table of GB/s and ns per access.
+int run_benchmarks(const struct bench_config *cfg, size_t min_ws, size_t max_ws, const int *threads, int nthreads,
+                   unsigned kernels, FILE *out, int format) {
+    const char *sep = "";
+    int json = format == FMT_JSON, csv = format == FMT_CSV;
+
+    fprintf(stderr, "Kernels: %s; working sets per thread; best of %d trials; %s pages\n", cfg->isa->name, TRIALS,
+            cfg->hugepages ? "transparent huge" : "base");
+    if (json) {
+        fprintf(out, "{\"isa\": \"%s\", \"hugepages\": %s, \"results\": [\n", cfg->isa->name,
+                cfg->hugepages ? "true" : "false");
+    } else if (csv) {
+        fprintf(out, "size,threads");
+        for (int k = 0; k < NUM_KERNELS; ++k) {
+            if (kernels & (1u << k)) fprintf(out, ",%s%s", kernel_names[k], k == K_CHASE ? "_ns" : "_gbs");
+        }
+        for (int k = 0; k < NUM_KERNELS && cfg->use_perf; ++k) {
+            char prefix[32];
+            snprintf(prefix, sizeof prefix, "%s_", kernel_names[k]);
+            if (kernels & (1u << k)) perf_print_csv_header(out, prefix);
+        }
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "%-8s %7s", "size", "threads");
+        for (int k = 0; k < NUM_KERNELS; ++k) {
+            if (!(kernels & (1u << k))) continue;
+            fprintf(out, " %10s", k == K_CHASE ? "chase ns" : kernel_names[k]);
+        }
+        fprintf(out, "\n");
+    }
+    for (size_t ws = min_ws; ws <= max_ws && !stop; ws *= 4) {
+        char size[16];
+        format_size(size, sizeof size, ws);
+        for (int t = 0; t < nthreads && !stop; ++t) {
+            if (json) fprintf(out, "%s    {\"size\": %zu, \"threads\": %d", sep, ws, threads[t]);
+            else if (csv) fprintf(out, "%zu,%d", ws, threads[t]);
+            else fprintf(out, "%-8s %7d", size, threads[t]);
+            struct perf_counters perf[NUM_KERNELS];
+            for (int k = 0; k < NUM_KERNELS; ++k) {
+                if (!(kernels & (1u << k))) continue;
+                double v = measure(cfg, k, ws, threads[t], &perf[k]);
+                if (json) fprintf(out, ", \"%s%s\": %.3f", kernel_names[k], k == K_CHASE ? "_ns" : "_gbs", v);
+                else if (csv) fprintf(out, ",%.3f", v);
+                else if (v < 0) fprintf(out, " %10s", "-");
+                else fprintf(out, " %10.2f", v);
+                if (json && cfg->use_perf) {
+                    fprintf(out, ", \"%s_counters\": ", kernel_names[k]);
+                    perf_print_json(&perf[k], out);
+                }
+                fflush(out);
+            }
+            for (int k = 0; k < NUM_KERNELS && cfg->use_perf && !json; ++k) {
+                if (!(kernels & (1u << k))) continue;
+                if (csv) {
+                    perf_print_csv(&perf[k], out);
+                } else {
+                    fprintf(out, "\n%16s %-6s", "", kernel_names[k]);
+                    perf_print(&perf[k], out);
+                }
+            }
+            if (json) fprintf(out, "}");
+            else fprintf(out, "\n");
+            fflush(out);
+            sep = ",\n";
+        }
+    }
+    if (json) fprintf(out, "\n  ]}\n");
+    fprintf(stderr, "(bandwidth columns in GB/s, counting only bytes read and written by the kernel)\n");
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c chunk_MB] [-r chunks_per_sec] [-m limit_MB|percent%%] [-n] [-P] [-f csv|json] [-o file]\n"
+                    "       %s -B [-s min[:max]] [-T threads,...] [-k kernels] [-I avx2|sse2|scalar] [-H] [-b bytes]\n"
+                    "          [-P] [-f csv|json] [-o file]\n",
+            prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
     void *ptr;
     size_t count = 0;
     size_t total_allocated = 0;
+    size_t chunk = CHUNK_SIZE;
+    double rate = 1000, percent = DEFAULT_PERCENT;
+    size_t limit = 0;
+    int touch = 1, json = 0, csv = 0;
+    const char *out_path = NULL;
+    int benchmark = 0;
+    struct bench_config cfg = { NULL, 0, 1UL << 30, 0 };
+    size_t min_ws = 16 * 1024, max_ws = 256 * 1024 * 1024;
+    int threads[MAX_BENCH_THREADS], nthreads = 0;
+    unsigned kernels = (1u << NUM_KERNELS) - 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:m:nf:o:Bs:T:k:I:Hb:Ph")) != -1) {
+        switch (opt) {
+        case 'B': benchmark = 1; break;
+        case 's': {
+            char *colon = strchr(optarg, ':');
+            min_ws = parse_size(optarg);
+            max_ws = colon ? parse_size(colon + 1) : min_ws;
+            break;
+        }
+        case 'T':
+            for (char *tok = strtok(optarg, ","); tok != NULL && nthreads < MAX_BENCH_THREADS; tok = strtok(NULL, ",")) {
+                threads[nthreads] = atoi(tok);
+                if (threads[nthreads] < 1 || threads[nthreads] > MAX_BENCH_THREADS) usage(argv[0]);
+                nthreads++;
+            }
+            break;
+        case 'k':
+            kernels = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int k;
+                for (k = 0; k < NUM_KERNELS && strcmp(tok, kernel_names[k]) != 0; ++k);
+                if (k == NUM_KERNELS) usage(argv[0]);
+                kernels |= 1u << k;
+            }
+            break;
+        case 'I':
+            for (int i = 0; i < NUM_ISAS; ++i) {
+                if (strcmp(optarg, isas[i].name) == 0) cfg.isa = &isas[i];
+            }
+            if (cfg.isa == NULL) usage(argv[0]);
+            if (!isa_supported(cfg.isa)) {
+                fprintf(stderr, "This CPU does not support %s.\n", cfg.isa->name);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H': cfg.hugepages = 1; break;
+        case 'P': cfg.use_perf = 1; break;
+        case 'b': cfg.bytes = parse_size(optarg); break;
+        case 'c': chunk = (size_t)(atof(optarg) * MB); break;
+        case 'r': rate = atof(optarg); break;
+        case 'm':
+            if (optarg[strlen(optarg) - 1] == '%') percent = atof(optarg);
+            else limit = (size_t)(atof(optarg) * MB);
+            break;
+        case 'n': touch = 0; break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) json = 1;
+            else if (strcmp(optarg, "csv") == 0) csv = 1;
+            else usage(argv[0]);
+            break;
+        case 'o': out_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (chunk == 0 || rate < 0 || percent <= 0) usage(argv[0]);
 
-    printf("Attempting to allocate memory in %d byte chunks until failure...\n", CHUNK_SIZE);
+    // the ramp measures in this thread, the benchmark in its workers
+    struct perf_counters perf;
+    if (cfg.use_perf) {
+        perf_open(&perf);
+        perf_report_missing(&perf, stderr);
+        if (benchmark) perf_close(&perf);
+    }
+
+    if (benchmark) {
+        if (min_ws < 1024 || max_ws < min_ws || kernels == 0 || cfg.bytes == 0) usage(argv[0]);
+        for (int i = 0; cfg.isa == NULL; ++i) {
+            if (isa_supported(&isas[i])) cfg.isa = &isas[i];
+        }
+        if (nthreads == 0) {
+            cpu_set_t set;
+            int cpus = sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : 1;
+            if (cpus > MAX_BENCH_THREADS) cpus = MAX_BENCH_THREADS;
+            for (int t = 1; t < cpus; t *= 2) threads[nthreads++] = t;
+            threads[nthreads++] = cpus;
+        }
+        FILE *out = stdout;
+        if (out_path != NULL && strcmp(out_path, "-") != 0 && (out = fopen(out_path, "w")) == NULL) {
+            perror(out_path);
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGINT, on_signal);
+        run_benchmarks(&cfg, min_ws, max_ws, threads, nthreads, kernels, out,
+                       json ? FMT_JSON : csv ? FMT_CSV : FMT_TABLE);
+        if (out != stdout) fclose(out);
+        return 0;
+    }
+
+    find_cgroup();
+    long long avail = mem_available();
+    long long cg_limit = cg_limit_path[0] ? read_number(cg_limit_path) : -1;
+    long long cg_usage = cg_usage_path[0] ? read_number(cg_usage_path) : -1;
+    if (limit == 0) {
+        long long budget = avail;
+        const char *basis = "MemAvailable";
+        if (cg_limit > 0 && cg_usage >= 0 && (budget < 0 || cg_limit - cg_usage < budget)) {
+            budget = cg_limit - cg_usage;
+            basis = "cgroup headroom";
+        }
+        if (budget <= 0) {
+            fprintf(stderr, "Cannot determine available memory; give -m in MB.\n");
+            exit(EXIT_FAILURE);
+        }
+        limit = (size_t)(budget * percent / 100.0);
+        fprintf(stderr, "Limit: %.0f%% of %s %.1f MB = %.1f MB\n", percent, basis, budget / MB, limit / MB);
+    }
+
+    FILE *out = stdout;
+    if (out_path != NULL && strcmp(out_path, "-") != 0 && (out = fopen(out_path, "w")) == NULL) {
+        perror(out_path);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    fprintf(stderr, "Allocating memory in %zu byte chunks at %g/s up to %zu bytes%s...\n", chunk, rate, limit,
+            touch ? "" : " without touching it");
+    if (json) {
+        fprintf(out, "{\"chunk_mb\": %.1f, \"rate\": %g, \"limit_mb\": %.1f, \"touch\": %s, "
+                "\"cgroup_limit_mb\": %.1f, \"samples\": [\n",
+                chunk / MB, rate, limit / MB, touch ? "true" : "false",
+                cg_limit > 0 && cg_limit < (long long)NO_LIMIT ? cg_limit / MB : -1.0);
+    } else {
+        fprintf(out, "t,step,total_mb,rss_mb,minflt,majflt,alloc_us,touch_us,avail_mb,cgroup_mb,psi_some10");
+        if (cfg.use_perf) perf_print_csv_header(out, "");
+        fprintf(out, "\n");
+    }
+
+    const char *reason = "limit reached";
+    long page = sysconf(_SC_PAGESIZE);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    long minflt = ru.ru_minflt, majflt = ru.ru_majflt;
+    double start = now_sec(), worst_alloc = 0, worst_touch = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!stop && total_allocated + chunk <= limit) {
+        if (rate > 0) {
+            // pace against absolute deadlines so the rate does not drift
+            long step_ns = (long)(1e9 / rate);
+            next.tv_nsec += step_ns % 1000000000L;
+            next.tv_sec += step_ns / 1000000000L + next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR && !stop);
+            if (stop) break;
+        }
 
-    while (1) {
-	usleep(1000);
         // Allocate a chunk of memory
-        ptr = malloc(CHUNK_SIZE);
+        if (cfg.use_perf) perf_start(&perf);
+        double t0 = now_sec();
+        ptr = malloc(chunk);
+        double t1 = now_sec();
 
         // Check if malloc failed
         if (ptr == NULL) {
             fprintf(stderr, "\nFailed to allocate memory chunk %zu.\n", count + 1);
-            
-            // Print system error message if available (optional, not guaranteed by C standard)
             if (errno) {
                 fprintf(stderr, "Reason: %s\n", strerror(errno));
             }
+            reason = "allocation failed";
             break; // Exit the loop on failure
         }
-        
-        // If successful, we don't need to free it in this specific program
-        // because the goal is to exhaust the memory.
-        // In a real program, you must free memory when done.
+        // make it resident: one write per page
+        if (touch) {
+            for (size_t off = 0; off < chunk; off += page) ((volatile char *)ptr)[off] = 1;
+        }
+        double t2 = now_sec();
+        if (cfg.use_perf) perf_stop(&perf);
 
+        // The chunks are never freed: the point is to hold the memory until
+        // the ramp ends, and the OS reclaims it all when the program exits.
         count++;
-        total_allocated += CHUNK_SIZE;
-        printf("Successfully allocated chunk %zu. Total allocated: %zu bytes.\n", count, total_allocated);
+        total_allocated += chunk;
+
+        struct sample s;
+        getrusage(RUSAGE_SELF, &ru);
+        s.t = t2 - start;
+        s.step = count;
+        s.total = total_allocated;
+        s.rss = current_rss();
+        s.minflt = ru.ru_minflt - minflt;
+        s.majflt = ru.ru_majflt - majflt;
+        s.alloc_us = (t1 - t0) * 1e6;
+        s.touch_us = (t2 - t1) * 1e6;
+        s.avail = mem_available();
+        s.cg_usage = cg_usage_path[0] ? read_number(cg_usage_path) : -1;
+        s.psi_some10 = psi_some_avg10();
+        s.perf = cfg.use_perf ? &perf : NULL;
+        minflt = ru.ru_minflt;
+        majflt = ru.ru_majflt;
+        if (s.alloc_us > worst_alloc) worst_alloc = s.alloc_us;
+        if (s.touch_us > worst_touch) worst_touch = s.touch_us;
+        write_sample(out, json, &s);
     }
+    if (stop) reason = "interrupted";
+
+    getrusage(RUSAGE_SELF, &ru);
+    double elapsed = now_sec() - start;
+    if (json) {
+        fprintf(out, "\n  ], \"stop\": \"%s\", \"steps\": %zu, \"total_mb\": %.1f, \"elapsed_s\": %.3f, "
+                "\"max_rss_mb\": %.1f, \"worst_alloc_us\": %.1f, \"worst_touch_us\": %.1f}\n",
+                reason, count, total_allocated / MB, elapsed, ru.ru_maxrss / 1024.0, worst_alloc, worst_touch);
+    }
+    if (out != stdout) fclose(out);
+    else fflush(out);
+
+    fprintf(stderr, "\nStopped (%s) after %zu chunks in %.2f s: %zu bytes (approx %.2f MB) allocated, "
+            "max RSS %.2f MB\n", reason, count, elapsed, total_allocated, total_allocated / MB, ru.ru_maxrss / 1024.0);
+    fprintf(stderr, "Worst step: malloc %.1f us, touch %.1f us\n", worst_alloc, worst_touch);
 
-    printf("\nTotal successfully allocated before failure: %zu bytes (approx %.2f MB).\n", total_allocated, (double)total_allocated / (1024 * 1024));
-    
     // Note: The allocated memory is not freed in this program as it's designed
-    // to exit after exhausting memory. The operating system reclaims all
+    // to exit right after the ramp. The operating system reclaims all
     // memory resources when the program terminates.
 
     return 0;
 }
-
@@ -1,111 +1,1475 @@
+// my-memory.c
+// Interactive memory allocator: allocate, free and list blocks by size in MB
+// Compile: gcc -Wall -O2 -pthread -o my-memory my-memory.c
+// Run: ./my-memory [-r trace|- [-a malloc|mmap|slab|arena] [-o binary_trace]]
+//
+// Commands: allocate <MB> [malloc|mmap|populate|thp|hugetlb], free <address>,
+// list [all], prefault [threads] [memset|page|populate] [bind|nobind],
+// arena ..., slab ..., bench [objsize] [count] [threads], quit
+//
+// Backends: malloc (the default) and mmap return untouched memory, which is
+// then faulted in by writing to it; populate is mmap with MAP_POPULATE, so
+// the kernel faults everything in during the call; thp is a 2 MB aligned
+// mmap with madvise(MADV_HUGEPAGE), so touching it faults whole transparent
+// huge pages; hugetlb is MAP_HUGETLB, which needs pages reserved in
+// /proc/sys/vm/nr_hugepages and rounds the size up to 2 MB. Every allocation
+// reports the time spent mapping and touching and the page faults taken
+// (from getrusage), which is where the huge page backends show their win.
+//
+// prefault sets how new blocks are faulted in: split at 2 MB aligned
+// addresses into chunks across the given number of threads, each of which
+// memsets its chunk (the default), writes one byte per page, or asks the
+// kernel to populate it with MADV_POPULATE_WRITE (falling back to page
+// touching on kernels without it). bind pins thread i to the i-th allowed
+// CPU. The touch step then reports GB/s and faults/s.
+//
+// Live blocks are tracked in an open-addressing hash table keyed by the
+// block's address (linear probing, backward-shift deletion, so no
+// tombstones), which makes free and lookup O(1) however many blocks exist.
+// Alongside it, per-size-class counters (classes are powers of two in MB)
+// let `list` summarise everything in constant time; the individual blocks
+// are only printed when there are few of them, or with `list all`.
+//
+// Beyond whole blocks, there are two small allocators to experiment with.
+// An arena is a bump pointer over 1 MB (or chunk_MB) mmapped chunks with
+// bulk reset; a slab hands out fixed-size objects from 64 KB pages, with a
+// per-thread cache of SLAB_CACHE objects in front of a locked free list.
+// The block records above come from slab 0. bench times count allocations
+// and frees of objsize bytes with malloc, a slab and an arena, on one
+// thread and on the given number, and reports ns/op and RSS per object.
+//
+// -r replays an allocation trace (format below, from a file or stdin)
+// instead of reading commands: events run with no output, against malloc,
+// one mmap per object, power-of-two slabs (mmap above 32 KB) or a single
+// never-freed arena, and at the end throughput, peak RSS and fragmentation
+// are reported. -o also writes the trace out in the compact binary format.
+// Command scripts can still be piped into the interactive mode.
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define MB_TO_BYTES(mb) ((size_t)(mb) * 1024 * 1024)
+#define INITIAL_SLOTS 1024
+#define NUM_CLASSES 65
+#define LIST_LIMIT 32   // `list` prints individual blocks up to this many
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define MAX_TOUCH_THREADS 256
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+enum backend { BACKEND_MALLOC, BACKEND_MMAP, BACKEND_POPULATE, BACKEND_THP, BACKEND_HUGETLB, NUM_BACKENDS };
+
+const char *backend_names[NUM_BACKENDS] = { "malloc", "mmap", "populate", "thp", "hugetlb" };
+
+enum touch_mode { TOUCH_MEMSET, TOUCH_PAGE, TOUCH_POPULATE, NUM_TOUCH_MODES };
+
+const char *touch_names[NUM_TOUCH_MODES] = { "memset", "page", "populate" };
+
+// How new blocks are faulted in; set with the prefault command.
+int touch_threads = 1;
+int touch_mode = TOUCH_MEMSET;
+int touch_bind = 0;
+
+// One thread's share of a block being faulted in.
+typedef struct TouchJob {
+    pthread_t thread;
+    char *start;
+    size_t length;
+    int cpu;            // CPU to pin to, or -1
+} TouchJob;
+
+// ---- Slab and arena allocators ----
+
+#define SLAB_PAGE (64 * 1024)
+#define SLAB_CACHE 64           // objects a thread keeps in its private cache
+#define MAX_SLABS 16            // slab 0 holds the MemoryBlock records
+#define MAX_ARENAS 16
+#define ARENA_CHUNK_MB 1
+#define ARENA_ALIGN 16
+
+// Fixed-size object pool. Objects are carved from the newest page only as
+// they are needed, so untouched memory stays untouched, and freed objects
+// go onto a shared free list; each thread also keeps up to SLAB_CACHE
+// objects of its own, so most allocations and frees touch no lock and no
+// shared line.
+typedef struct Slab {
+    size_t objsize;
+    size_t page_bytes;
+    pthread_mutex_t lock;
+    void *free_list;            // shared free objects, linked through their first word
+    char *carve, *carve_end;    // not yet used part of the newest page
+    void **pages;               // every page, for destroy
+    size_t num_pages, pages_cap;
+    void **held;                // objects allocated by `slab alloc`
+    size_t num_held, held_cap;
+} Slab;
+
+typedef struct SlabCache {
+    void *objs[SLAB_CACHE];
+    int count;
+} SlabCache;
+
+// Bump-pointer arena over a chain of mmapped chunks. Reset rewinds to the
+// first chunk and keeps every chunk for reuse.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;                // bytes of data[]
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    size_t chunk_size;
+    ArenaChunk *chunks, *current;
+    char *cur, *end;
+    size_t allocs, bytes;       // since the last reset
+} Arena;
+
+Slab *slabs[MAX_SLABS];
+Arena *arenas[MAX_ARENAS];
+__thread SlabCache slab_caches[MAX_SLABS];
+
+Slab *slab_create(size_t objsize) {
+    Slab *slab = calloc(1, sizeof *slab);
+    if (slab == NULL) return NULL;
+    // room for the free-list link, and keep objects 16-byte aligned
+    if (objsize < sizeof(void *)) objsize = sizeof(void *);
+    slab->objsize = (objsize + 15) & ~(size_t)15;
+    slab->page_bytes = SLAB_PAGE;
+    if (slab->page_bytes < slab->objsize * 8) slab->page_bytes = (slab->objsize * 8 + 4095) & ~(size_t)4095;
+    pthread_mutex_init(&slab->lock, NULL);
+    return slab;
+}
+
+// Map a fresh page to carve from; called with the lock held.
+int slab_grow(Slab *slab) {
+    if (slab->num_pages == slab->pages_cap) {
+        size_t cap = slab->pages_cap ? slab->pages_cap * 2 : 16;
+        void **pages = realloc(slab->pages, cap * sizeof *pages);
+        if (pages == NULL) return -1;
+        slab->pages = pages;
+        slab->pages_cap = cap;
+    }
+    char *page = mmap(NULL, slab->page_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) return -1;
+    slab->pages[slab->num_pages++] = page;
+    slab->carve = page;
+    slab->carve_end = page + slab->page_bytes / slab->objsize * slab->objsize;
+    return 0;
+}
+
+void *slab_alloc(int id) {
+    Slab *slab = slabs[id];
+    SlabCache *cache = &slab_caches[id];
+    if (cache->count == 0) {
+        // refill half the cache in one trip to the shared list
+        pthread_mutex_lock(&slab->lock);
+        while (cache->count < SLAB_CACHE / 2) {
+            if (slab->free_list != NULL) {
+                void **obj = slab->free_list;
+                slab->free_list = *obj;
+                cache->objs[cache->count++] = obj;
+                continue;
+            }
+            if (slab->carve == slab->carve_end && slab_grow(slab) != 0) break;
+            cache->objs[cache->count++] = slab->carve;
+            slab->carve += slab->objsize;
+        }
+        pthread_mutex_unlock(&slab->lock);
+        if (cache->count == 0) return NULL;
+    }
+    return cache->objs[--cache->count];
+}
+
+// Return a thread's cached objects, down to keep, to the shared list.
+void slab_flush(int id, int keep) {
+    Slab *slab = slabs[id];
+    SlabCache *cache = &slab_caches[id];
+    pthread_mutex_lock(&slab->lock);
+    while (cache->count > keep) {
+        void **obj = cache->objs[--cache->count];
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_free(int id, void *obj) {
+    SlabCache *cache = &slab_caches[id];
+    if (cache->count == SLAB_CACHE) slab_flush(id, SLAB_CACHE / 2);
+    cache->objs[cache->count++] = obj;
+}
+
+// Only safe once no other thread holds objects of the slab in its cache.
+void slab_destroy(int id) {
+    Slab *slab = slabs[id];
+    for (size_t i = 0; i < slab->num_pages; ++i) munmap(slab->pages[i], slab->page_bytes);
+    pthread_mutex_destroy(&slab->lock);
+    free(slab->pages);
+    free(slab->held);
+    free(slab);
+    slabs[id] = NULL;
+    slab_caches[id].count = 0;
+}
+
+Arena *arena_create(size_t chunk_size) {
+    Arena *arena = calloc(1, sizeof *arena);
+    if (arena != NULL) arena->chunk_size = chunk_size;
+    return arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    // no chunk can hold it once rounded up and given a header
+    if (size > SIZE_MAX - sizeof(ArenaChunk) - 4095 - ARENA_ALIGN) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    while ((size_t)(arena->end - arena->cur) < size) {
+        ArenaChunk *next = arena->current ? arena->current->next : arena->chunks;
+        if (next == NULL || next->size < size) {
+            // chunk data stays ARENA_ALIGN aligned: the header is 16 bytes
+            size_t bytes = arena->chunk_size;
+            if (bytes < size + sizeof(ArenaChunk)) bytes = (size + sizeof(ArenaChunk) + 4095) & ~(size_t)4095;
+            ArenaChunk *chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED) return NULL;
+            chunk->size = bytes - sizeof(ArenaChunk);
+            // splice in after the current chunk so reused ones stay ahead
+            if (arena->current) {
+                chunk->next = arena->current->next;
+                arena->current->next = chunk;
+            } else {
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+            }
+            next = chunk;
+        }
+        arena->current = next;
+        arena->cur = next->data;
+        arena->end = next->data + next->size;
+    }
+    void *ptr = arena->cur;
+    arena->cur += size;
+    arena->allocs++;
+    arena->bytes += size;
+    return ptr;
+}
 
-#define MB_TO_BYTES(mb) (mb * 1024 * 1024)
+void arena_reset(Arena *arena) {
+    arena->current = NULL;
+    arena->cur = arena->end = NULL;
+    arena->allocs = arena->bytes = 0;
+}
+
+size_t arena_mapped(const Arena *arena) {
+    size_t bytes = 0;
+    for (const ArenaChunk *c = arena->chunks; c != NULL; c = c->next) bytes += c->size + sizeof(ArenaChunk);
+    return bytes;
+}
+
+void arena_destroy(Arena *arena) {
+    ArenaChunk *c = arena->chunks;
+    while (c != NULL) {
+        ArenaChunk *next = c->next;
+        munmap(c, c->size + sizeof(ArenaChunk));
+        c = next;
+    }
+    free(arena);
+}
 
 // Structure to track allocated blocks
 typedef struct MemoryBlock {
     void *pointer;
     size_t size_mb;
-    struct MemoryBlock *next;
+    size_t length;      // bytes mapped, for munmap
+    int backend;
 } MemoryBlock;
 
-MemoryBlock *head = NULL; // Head of the linked list of allocated blocks
+// Aggregates for blocks of 2^(class-1) .. 2^class - 1 MB; class 0 is 0 MB.
+typedef struct SizeClass {
+    size_t blocks;
+    size_t total_mb;
+} SizeClass;
+
+MemoryBlock **slots = NULL;     // open-addressing table, NULL means empty
+size_t num_slots = 0;           // always a power of two
+size_t num_blocks = 0;
+size_t total_mb = 0;
+SizeClass classes[NUM_CLASSES];
+
+// Spread pointer bits over the whole word; low bits of malloc'd
+// addresses are mostly zero.
+size_t hash_pointer(const void *ptr) {
+    uint64_t h = (uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+int size_class(size_t size_mb) {
+    return size_mb == 0 ? 0 : 64 - __builtin_clzll(size_mb);
+}
+
+// Returns the slot holding ptr, or the empty slot where it would go.
+size_t find_slot(const void *ptr) {
+    size_t mask = num_slots - 1;
+    size_t i = hash_pointer(ptr) & mask;
+    while (slots[i] != NULL && slots[i]->pointer != ptr) i = (i + 1) & mask;
+    return i;
+}
 
-// Function to add a new block to the tracking list
-void add_block(void *ptr, size_t size_mb) {
-    MemoryBlock *new_block = (MemoryBlock *)malloc(sizeof(MemoryBlock));
+void grow_table() {
+    MemoryBlock **old = slots;
+    size_t old_slots = num_slots;
+
+    num_slots = old_slots ? old_slots * 2 : INITIAL_SLOTS;
+    slots = calloc(num_slots, sizeof *slots);
+    if (slots == NULL) {
+        perror("Failed to allocate memory for tracking table");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_slots; ++i) {
+        if (old[i] != NULL) slots[find_slot(old[i]->pointer)] = old[i];
+    }
+    free(old);
+}
+
+void account(size_t size_mb, int sign) {
+    SizeClass *sc = &classes[size_class(size_mb)];
+    if (sign > 0) {
+        sc->blocks++;
+        sc->total_mb += size_mb;
+        num_blocks++;
+        total_mb += size_mb;
+    } else {
+        sc->blocks--;
+        sc->total_mb -= size_mb;
+        num_blocks--;
+        total_mb -= size_mb;
+    }
+}
+
+// Function to add a new block to the tracking table
+void add_block(void *ptr, size_t size_mb, size_t length, int backend) {
+    // keep the load factor at or below 1/2 so probe runs stay short
+    if ((num_blocks + 1) * 2 > num_slots) grow_table();
+
+    MemoryBlock *new_block = (MemoryBlock *)slab_alloc(0);
     if (new_block == NULL) {
         perror("Failed to allocate memory for tracking structure");
         exit(EXIT_FAILURE);
     }
     new_block->pointer = ptr;
     new_block->size_mb = size_mb;
-    new_block->next = head;
-    head = new_block;
+    new_block->length = length;
+    new_block->backend = backend;
+    slots[find_slot(ptr)] = new_block;
+    account(size_mb, 1);
 }
 
-// Function to remove and free a block from the tracking list
-void remove_block(void *ptr) {
-    MemoryBlock *current = head;
-    MemoryBlock *prev = NULL;
+// Empty slot i, then pull back any later entry of the same probe run that
+// would otherwise become unreachable.
+void delete_slot(size_t i) {
+    size_t mask = num_slots - 1;
+    size_t j = i;
 
-    while (current != NULL && current->pointer != ptr) {
-        prev = current;
-        current = current->next;
+    slots[i] = NULL;
+    while (1) {
+        j = (j + 1) & mask;
+        if (slots[j] == NULL) return;
+        size_t home = hash_pointer(slots[j]->pointer) & mask;
+        // move slots[j] into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            slots[j] = NULL;
+            i = j;
+        }
     }
+}
 
-    if (current == NULL) {
-        printf("Error: Pointer not found in the allocated list.\n");
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void page_faults(long *minor, long *major) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *minor = ru.ru_minflt;
+    *major = ru.ru_majflt;
+}
+
+// Map *length bytes with the given backend, adjusting *length to what was
+// actually mapped. Returns NULL with errno set on failure.
+void *map_block(size_t *length, int backend) {
+    void *ptr;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    switch (backend) {
+    case BACKEND_MALLOC:
+        return malloc(*length);
+    case BACKEND_POPULATE:
+        flags |= MAP_POPULATE;
+        break;
+    case BACKEND_THP: {
+        // over-map by a huge page and trim, so the block starts 2 MB aligned
+        // and every whole 2 MB of it can be backed by one huge page
+        char *raw = mmap(NULL, *length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+        char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > raw) munmap(raw, aligned - raw);
+        munmap(aligned + *length, raw + HUGE_PAGE_SIZE - aligned);
+        if (madvise(aligned, *length, MADV_HUGEPAGE) != 0) perror("madvise(MADV_HUGEPAGE)");
+        return aligned;
+    }
+    case BACKEND_HUGETLB:
+        flags |= MAP_HUGETLB;
+        *length = (*length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        break;
+    }
+    ptr = mmap(NULL, *length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void unmap_block(MemoryBlock *block) {
+    if (block->backend == BACKEND_MALLOC) free(block->pointer);
+    else munmap(block->pointer, block->length);
+}
+
+void *touch_thread(void *arg) {
+    TouchJob *job = arg;
+    static int warned = 0;
+
+    if (job->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(job->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+    if (touch_mode == TOUCH_MEMSET) {
+        memset(job->start, 1, job->length);
+        return NULL;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (touch_mode == TOUCH_POPULATE) {
+        // madvise() wants page-aligned ranges, which malloc blocks and
+        // their chunks are not; the pages they share are mapped anyway
+        uintptr_t start = (uintptr_t)job->start & ~(page - 1);
+        uintptr_t end = ((uintptr_t)job->start + job->length + page - 1) & ~(page - 1);
+        if (madvise((void *)start, end - start, MADV_POPULATE_WRITE) == 0) return NULL;
+        // kernels before 5.14 do not know the advice; touch the pages instead
+        if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) perror("madvise(MADV_POPULATE_WRITE)");
+    }
+    for (size_t off = 0; off < job->length; off += page) ((volatile char *)job->start)[off] = 1;
+    return NULL;
+}
+
+// The i-th CPU this process may run on, wrapping around.
+int nth_allowed_cpu(int i) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0 || CPU_COUNT(&set) == 0) return -1;
+    i %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set) && i-- == 0) return cpu;
+    }
+    return -1;
+}
+
+// Fault in a block with the prefault settings. The block is split at 2 MB
+// aligned addresses (not offsets, as malloc blocks are not aligned), so no
+// two threads fault the same huge page. Returns the threads used.
+int touch_block(char *ptr, size_t length) {
+    TouchJob jobs[MAX_TOUCH_THREADS];
+    uintptr_t first = (uintptr_t)ptr & ~(HUGE_PAGE_SIZE - 1), end = (uintptr_t)ptr + length;
+    size_t chunks = (end - first + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+    int nthreads = touch_threads;
+
+    if ((size_t)nthreads > chunks) nthreads = chunks ? chunks : 1;
+    size_t chunk = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        size_t share = chunks / nthreads + ((size_t)i < chunks % nthreads);
+        uintptr_t from = first + chunk * HUGE_PAGE_SIZE, to = from + share * HUGE_PAGE_SIZE;
+        // the first and last chunks are clipped to the block
+        if (from < (uintptr_t)ptr) from = (uintptr_t)ptr;
+        if (to > end) to = end;
+        jobs[i].start = (char *)from;
+        jobs[i].length = to > from ? to - from : 0;
+        jobs[i].cpu = touch_bind ? nth_allowed_cpu(i) : -1;
+        chunk += share;
+    }
+    // the calling thread takes the first chunk itself
+    int started = 1;
+    for (int i = 1; i < nthreads; ++i, ++started) {
+        if (pthread_create(&jobs[i].thread, NULL, touch_thread, &jobs[i]) != 0) break;
+    }
+    for (int i = started; i < nthreads; ++i) touch_thread(&jobs[i]);
+    cpu_set_t saved;
+    int restore = touch_bind && sched_getaffinity(0, sizeof saved, &saved) == 0;
+    touch_thread(&jobs[0]);
+    if (restore) sched_setaffinity(0, sizeof saved, &saved);
+    for (int i = 1; i < started; ++i) pthread_join(jobs[i].thread, NULL);
+    return nthreads;
+}
+
+// Allocate and fault in size_mb MB with the given backend, reporting how
+// long each step took and how many page faults it cost.
+void allocate_block(size_t size_mb, int backend) {
+    size_t length = MB_TO_BYTES(size_mb);
+    long minor0, major0, minor1, major1, minor2, major2;
+
+    page_faults(&minor0, &major0);
+    double t0 = now_ms();
+    void *ptr = map_block(&length, backend);
+    double t1 = now_ms();
+    if (ptr == NULL) {
+        int err = errno;
+        perror("Memory allocation failed");
+        if (backend == BACKEND_HUGETLB && err == ENOMEM) {
+            printf("No free huge pages; reserve some in /proc/sys/vm/nr_hugepages.\n");
+        }
         return;
     }
+    page_faults(&minor1, &major1);
+    // populate already faulted everything in; the others fault on first write
+    int threads = backend != BACKEND_POPULATE ? touch_block(ptr, length) : 0;
+    double t2 = now_ms();
+    page_faults(&minor2, &major2);
 
-    if (prev == NULL) {
-        head = current->next;
-    } else {
-        prev->next = current->next;
+    long map_faults = (minor1 - minor0) + (major1 - major0);
+    long touch_faults = (minor2 - minor1) + (major2 - major1);
+    add_block(ptr, size_mb, length, backend);
+    printf("Allocated %zu MB at address %p (%s)\n", size_mb, ptr, backend_names[backend]);
+    printf("  map %.3f ms, %ld faults; touch %.3f ms, %ld faults; total %.3f ms",
+           t1 - t0, map_faults, t2 - t1, touch_faults, t2 - t0);
+    if (t2 > t0) printf(", %.1f MB/s", size_mb / ((t2 - t0) / 1e3));
+    printf("\n");
+    if (threads > 0 && t2 > t1) {
+        double secs = (t2 - t1) / 1e3;
+        printf("  touch: %d thread%s, %s%s: %.2f GB/s, %.0f faults/s\n", threads, threads == 1 ? "" : "s",
+               touch_names[touch_mode], touch_bind ? ", bound" : "", length / secs / 1e9, touch_faults / secs);
+    }
+}
+
+// Function to remove and free a block from the tracking table
+void remove_block(void *ptr) {
+    size_t i = num_slots ? find_slot(ptr) : 0;
+    if (num_slots == 0 || slots[i] == NULL) {
+        printf("Error: Pointer not found in the allocated list.\n");
+        return;
     }
 
-    free(current->pointer); // Free the actual allocated memory
-    free(current); // Free the tracking structure
-    printf("Freed a block of %zu MB.\n", current->size_mb);
+    MemoryBlock *block = slots[i];
+    size_t size_mb = block->size_mb;
+    delete_slot(i);
+    account(size_mb, -1);
+
+    unmap_block(block); // Free the actual allocated memory
+    slab_free(0, block); // Free the tracking structure
+    printf("Freed a block of %zu MB.\n", size_mb);
 }
 
-// Function to print all allocated blocks
-void print_blocks() {
-    MemoryBlock *current = head;
-    if (current == NULL) {
+// Function to print the allocated blocks: a per-size-class summary, plus
+// every block when there are at most LIST_LIMIT of them or all is set
+void print_blocks(int all) {
+    if (num_blocks == 0) {
         printf("No memory blocks currently allocated.\n");
         return;
     }
-    printf("--- Current Allocated Blocks ---\n");
-    while (current != NULL) {
-        printf("Address: %p, Size: %zu MB\n", current->pointer, current->size_mb);
-        current = current->next;
+    if (all || num_blocks <= LIST_LIMIT) {
+        printf("--- Current Allocated Blocks ---\n");
+        for (size_t i = 0; i < num_slots; ++i) {
+            if (slots[i] != NULL) {
+                printf("Address: %p, Size: %zu MB, Backend: %s\n", slots[i]->pointer, slots[i]->size_mb,
+                       backend_names[slots[i]->backend]);
+            }
+        }
     }
+    printf("--- Blocks by Size Class ---\n");
+    for (int c = 0; c < NUM_CLASSES; ++c) {
+        if (classes[c].blocks == 0) continue;
+        if (c <= 1) {
+            printf("%d MB: %zu blocks, %zu MB\n", c, classes[c].blocks, classes[c].total_mb);
+        } else {
+            printf("%zu-%zu MB: %zu blocks, %zu MB\n", (size_t)1 << (c - 1), ((size_t)1 << (c - 1)) * 2 - 1,
+                   classes[c].blocks, classes[c].total_mb);
+        }
+    }
+    printf("Total: %zu blocks, %zu MB\n", num_blocks, total_mb);
     printf("--------------------------------\n");
 }
 
 // Function to free all remaining blocks before exiting
 void free_all_blocks() {
-    MemoryBlock *current = head;
-    while (current != NULL) {
-        MemoryBlock *next = current->next;
-        free(current->pointer);
-        free(current);
-        current = next;
-    }
-    head = NULL;
+    for (size_t i = 0; i < num_slots; ++i) {
+        if (slots[i] == NULL) continue;
+        unmap_block(slots[i]);
+        slab_free(0, slots[i]);
+    }
+    free(slots);
+    slots = NULL;
+    num_slots = 0;
+    num_blocks = 0;
+    total_mb = 0;
+    memset(classes, 0, sizeof classes);
     printf("All allocated memory freed.\n");
 }
 
-int main() {
+// Read an optional argument from the rest of the current input line into
+// buf; leaves buf empty if the line has none.
+void read_optional_word(char *buf, int size) {
+    char fmt[16];
+    int ch;
+
+    buf[0] = '\0';
+    while ((ch = getchar()) == ' ' || ch == '\t');
+    if (ch == EOF || ch == '\n') return;
+    ungetc(ch, stdin);
+    snprintf(fmt, sizeof fmt, "%%%ds", size - 1);
+    if (scanf(fmt, buf) != 1) buf[0] = '\0';
+}
+
+// Resident set size in bytes. smaps_rollup walks the page tables, so it is
+// exact where statm's counters may lag behind recent faults.
+size_t current_rss() {
+    char line[128];
+    unsigned long kb = 0, size, resident;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof line, f) != NULL) {
+            if (sscanf(line, "Rss: %lu kB", &kb) == 1) break;
+        }
+        fclose(f);
+        if (kb > 0) return kb * 1024;
+    }
+    if ((f = fopen("/proc/self/statm", "r")) == NULL) return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void print_slabs() {
+    for (int id = 0; id < MAX_SLABS; ++id) {
+        Slab *slab = slabs[id];
+        if (slab == NULL) continue;
+        size_t objects = id == 0 ? num_blocks : slab->num_held;
+        printf("Slab %d: %zu-byte objects, %zu pages, %zu KB mapped, %zu allocated%s\n", id, slab->objsize,
+               slab->num_pages, slab->num_pages * slab->page_bytes / 1024, objects, id == 0 ? " (block records)" : "");
+    }
+}
+
+void print_arenas() {
+    int any = 0;
+    for (int id = 0; id < MAX_ARENAS; ++id) {
+        Arena *arena = arenas[id];
+        if (arena == NULL) continue;
+        printf("Arena %d: %zu allocations, %zu KB used, %zu KB mapped\n", id, arena->allocs, arena->bytes / 1024,
+               arena_mapped(arena) / 1024);
+        any = 1;
+    }
+    if (!any) printf("No arenas.\n");
+}
+
+// slab new <objsize> | alloc <id> <count> | free <id> <count> | destroy <id>
+void slab_command() {
+    char sub[16];
+    int id;
+    size_t n;
+
+    read_optional_word(sub, sizeof sub);
+    if (sub[0] == '\0') {
+        print_slabs();
+        return;
+    }
+    if (strcmp(sub, "new") == 0) {
+        if (scanf("%zu", &n) != 1 || n == 0 || n > MB_TO_BYTES(1)) {
+            printf("Usage: slab new <objsize bytes, up to 1 MB>\n");
+            return;
+        }
+        for (id = 1; id < MAX_SLABS && slabs[id] != NULL; ++id);
+        if (id == MAX_SLABS || (slabs[id] = slab_create(n)) == NULL) {
+            printf("Error: no room for another slab.\n");
+            return;
+        }
+        printf("Slab %d: %zu-byte objects\n", id, slabs[id]->objsize);
+        return;
+    }
+    if (scanf("%d", &id) != 1 || id < 1 || id >= MAX_SLABS || slabs[id] == NULL) {
+        printf("Error: no such slab.\n");
+        return;
+    }
+    Slab *slab = slabs[id];
+    if (strcmp(sub, "destroy") == 0) {
+        slab_destroy(id);
+        printf("Slab %d destroyed.\n", id);
+        return;
+    }
+    if (scanf("%zu", &n) != 1) {
+        printf("Usage: slab alloc|free <id> <count>\n");
+        return;
+    }
+    double t0 = now_ms();
+    if (strcmp(sub, "alloc") == 0) {
+        if (slab->num_held + n > slab->held_cap) {
+            size_t cap = slab->held_cap ? slab->held_cap : 1024;
+            while (cap < slab->num_held + n) cap *= 2;
+            void **held = realloc(slab->held, cap * sizeof *held);
+            if (held == NULL) {
+                perror("realloc");
+                return;
+            }
+            slab->held = held;
+            slab->held_cap = cap;
+        }
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            void *obj = slab_alloc(id);
+            if (obj == NULL) break;
+            slab->held[slab->num_held++] = obj;
+        }
+        if (i < n) perror("slab alloc");
+        n = i;
+    } else if (strcmp(sub, "free") == 0) {
+        if (n > slab->num_held) n = slab->num_held;
+        for (size_t i = 0; i < n; ++i) slab_free(id, slab->held[--slab->num_held]);
+    } else {
+        printf("Usage: slab new|alloc|free|destroy ...\n");
+        return;
+    }
+    double ms = now_ms() - t0;
+    printf("%s %zu objects in slab %d in %.3f ms (%.1f ns/op)\n", sub[0] == 'a' ? "Allocated" : "Freed", n, id, ms,
+           n ? ms * 1e6 / n : 0.0);
+}
+
+// arena new [chunk MB] | alloc <id> <count> <size> | reset <id> | destroy <id>
+void arena_command() {
+    char sub[16];
+    int id;
+    size_t n, size;
+
+    read_optional_word(sub, sizeof sub);
+    if (sub[0] == '\0') {
+        print_arenas();
+        return;
+    }
+    if (strcmp(sub, "new") == 0) {
+        char arg[16];
+        read_optional_word(arg, sizeof arg);
+        size_t chunk_mb = arg[0] ? strtoul(arg, NULL, 10) : ARENA_CHUNK_MB;
+        if (chunk_mb == 0) chunk_mb = ARENA_CHUNK_MB;
+        for (id = 0; id < MAX_ARENAS && arenas[id] != NULL; ++id);
+        if (id == MAX_ARENAS || (arenas[id] = arena_create(MB_TO_BYTES(chunk_mb))) == NULL) {
+            printf("Error: no room for another arena.\n");
+            return;
+        }
+        printf("Arena %d: %zu MB chunks\n", id, chunk_mb);
+        return;
+    }
+    if (scanf("%d", &id) != 1 || id < 0 || id >= MAX_ARENAS || arenas[id] == NULL) {
+        printf("Error: no such arena.\n");
+        return;
+    }
+    Arena *arena = arenas[id];
+    if (strcmp(sub, "reset") == 0) {
+        size_t allocs = arena->allocs;
+        arena_reset(arena);
+        printf("Arena %d reset, %zu allocations released.\n", id, allocs);
+    } else if (strcmp(sub, "destroy") == 0) {
+        arena_destroy(arena);
+        arenas[id] = NULL;
+        printf("Arena %d destroyed.\n", id);
+    } else if (strcmp(sub, "alloc") == 0) {
+        if (scanf("%zu %zu", &n, &size) != 2) {
+            printf("Usage: arena alloc <id> <count> <size>\n");
+            return;
+        }
+        double t0 = now_ms();
+        size_t i;
+        for (i = 0; i < n && arena_alloc(arena, size) != NULL; ++i);
+        double ms = now_ms() - t0;
+        if (i < n) perror("arena alloc");
+        printf("Allocated %zu objects of %zu bytes from arena %d in %.3f ms (%.1f ns/op)\n", i, size, id, ms,
+               i ? ms * 1e6 / i : 0.0);
+    } else {
+        printf("Usage: arena new|alloc|reset|destroy ...\n");
+    }
+}
+
+void free_allocators() {
+    for (int id = 0; id < MAX_ARENAS; ++id) {
+        if (arenas[id] != NULL) arena_destroy(arenas[id]);
+        arenas[id] = NULL;
+    }
+    for (int id = 0; id < MAX_SLABS; ++id) {
+        if (slabs[id] != NULL) slab_destroy(id);
+    }
+}
+
+// ---- Allocator microbenchmark ----
+
+enum bench_allocator { BENCH_MALLOC, BENCH_SLAB, BENCH_ARENA, NUM_BENCH_ALLOCATORS };
+
+const char *bench_names[NUM_BENCH_ALLOCATORS] = { "malloc", "slab", "arena" };
+
+typedef struct BenchJob {
+    pthread_t thread;
+    int index;
+    int allocator;
+    int slab_id;
+    Arena *arena;
+    size_t objsize, count;
+    int rounds;
+    void **objs;
+    double alloc_ns, free_ns;   // totals over all rounds
+    pthread_barrier_t *barrier;
+    size_t *base_rss, *peak_rss;
+} BenchJob;
+
+// Every thread allocates count objects, writing to each, then frees them
+// all (an arena just resets), for the given number of rounds. Thread 0
+// samples RSS just before and just after the first round's allocations,
+// so the difference is what the live objects cost from a cold start.
+void *bench_thread(void *arg) {
+    BenchJob *job = arg;
+
+    for (int r = 0; r < job->rounds; ++r) {
+        pthread_barrier_wait(job->barrier);
+        if (r == 0 && job->index == 0) *job->base_rss = current_rss();
+        pthread_barrier_wait(job->barrier);
+        double t0 = now_ms();
+        for (size_t i = 0; i < job->count; ++i) {
+            void *p;
+            if (job->allocator == BENCH_MALLOC) p = malloc(job->objsize);
+            else if (job->allocator == BENCH_SLAB) p = slab_alloc(job->slab_id);
+            else p = arena_alloc(job->arena, job->objsize);
+            if (p == NULL) {
+                perror("bench alloc");
+                exit(EXIT_FAILURE);
+            }
+            *(volatile char *)p = 1;
+            job->objs[i] = p;
+        }
+        double t1 = now_ms();
+        pthread_barrier_wait(job->barrier);
+        if (r == 0 && job->index == 0) *job->peak_rss = current_rss();
+        pthread_barrier_wait(job->barrier);
+        double t2 = now_ms();
+        if (job->allocator == BENCH_MALLOC) {
+            for (size_t i = 0; i < job->count; ++i) free(job->objs[i]);
+        } else if (job->allocator == BENCH_SLAB) {
+            for (size_t i = 0; i < job->count; ++i) slab_free(job->slab_id, job->objs[i]);
+        } else {
+            arena_reset(job->arena);
+        }
+        double t3 = now_ms();
+        job->alloc_ns += (t1 - t0) * 1e6;
+        job->free_ns += (t3 - t2) * 1e6;
+    }
+    if (job->allocator == BENCH_SLAB) slab_flush(job->slab_id, 0);
+    return NULL;
+}
+
+void run_bench(int allocator, size_t objsize, size_t count, int nthreads, int rounds) {
+    BenchJob *jobs = calloc(nthreads, sizeof *jobs);
+    pthread_barrier_t barrier;
+    size_t base_rss = 0, peak_rss = 0;
+    int slab_id = -1;
+
+    if (jobs == NULL) {
+        perror("calloc");
+        return;
+    }
+    if (allocator == BENCH_SLAB) {
+        for (slab_id = 1; slab_id < MAX_SLABS && slabs[slab_id] != NULL; ++slab_id);
+        if (slab_id == MAX_SLABS || (slabs[slab_id] = slab_create(objsize)) == NULL) {
+            printf("  %-7s skipped: no free slab slot\n", bench_names[allocator]);
+            free(jobs);
+            return;
+        }
+    }
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        BenchJob *job = &jobs[i];
+        job->index = i;
+        job->allocator = allocator;
+        job->slab_id = slab_id;
+        job->objsize = objsize;
+        job->count = count;
+        job->rounds = rounds;
+        job->barrier = &barrier;
+        job->base_rss = &base_rss;
+        job->peak_rss = &peak_rss;
+        job->objs = malloc(count * sizeof *job->objs);
+        if (job->objs == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        // fault the pointer array in now so it does not count against the allocator
+        for (size_t j = 0; j < count; ++j) job->objs[j] = job;
+        if (allocator == BENCH_ARENA && (job->arena = arena_create(MB_TO_BYTES(ARENA_CHUNK_MB))) == NULL) {
+            perror("arena_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double t0 = now_ms();
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&jobs[i].thread, NULL, bench_thread, &jobs[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double alloc_ns = 0, free_ns = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        alloc_ns += jobs[i].alloc_ns;
+        free_ns += jobs[i].free_ns;
+    }
+    double wall = now_ms() - t0;
+
+    double ops = (double)count * nthreads * rounds;
+    double requested = (double)count * nthreads * objsize;
+    double overhead = ((double)peak_rss - base_rss - requested) / (count * nthreads);
+    printf("  %-7s %7.1f %7.1f %10.2f %12.1f\n", bench_names[allocator], alloc_ns / ops, free_ns / ops,
+           2 * ops / (wall * 1e3), overhead);
+
+    for (int i = 0; i < nthreads; ++i) {
+        free(jobs[i].objs);
+        if (jobs[i].arena) arena_destroy(jobs[i].arena);
+    }
+    if (slab_id > 0) slab_destroy(slab_id);
+    pthread_barrier_destroy(&barrier);
+    free(jobs);
+}
+
+// bench [objsize] [count] [threads]: compare malloc, slab and arena at one
+// thread and, if asked, at several.
+void bench_command() {
+    char arg[24];
+    size_t objsize = 64, count = 1000000;
+    int nthreads = 1;
+
+    read_optional_word(arg, sizeof arg);
+    if (arg[0]) objsize = strtoul(arg, NULL, 10);
+    read_optional_word(arg, sizeof arg);
+    if (arg[0]) count = strtoul(arg, NULL, 10);
+    read_optional_word(arg, sizeof arg);
+    if (arg[0]) nthreads = atoi(arg);
+    if (objsize == 0 || objsize > MB_TO_BYTES(1) || count == 0 || nthreads < 1 || nthreads > MAX_TOUCH_THREADS) {
+        printf("Usage: bench [objsize] [count] [threads]\n");
+        return;
+    }
+    for (int threads = 1; threads <= nthreads; threads = threads == nthreads ? nthreads + 1 : nthreads) {
+        printf("%zu objects of %zu bytes per thread, %d thread%s, 5 rounds\n", count, objsize, threads,
+               threads == 1 ? "" : "s");
+        printf("  %-7s %7s %7s %10s %12s\n", "", "alloc", "free", "Mops/s", "RSS B/obj");
+        for (int a = 0; a < NUM_BENCH_ALLOCATORS; ++a) {
+            // each run gets a fresh process, so memory one allocator keeps
+            // cached (malloc's arenas especially) cannot skew the next RSS
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                run_bench(a, objsize, count, threads, 5);
+                fflush(stdout);
+                _exit(0);
+            }
+            if (pid < 0) perror("fork");
+            else waitpid(pid, NULL, 0);
+        }
+    }
+    printf("(ns/op per thread; RSS B/obj is resident bytes per object beyond its size)\n");
+}
+
+// ---- Trace replay ----
+//
+// A trace is a sequence of events on objects named by integer ids
+// (allocation sequence numbers or addresses, typically):
+//   text:   "a <id> <bytes>", "f <id>", "t <id>" per line; '#' starts a comment
+//   binary: TRACE_MAGIC, then per event one op byte ('a', 'f' or 't'), the
+//           id and, for 'a', the size, both as LEB128 varints
+// The format is detected from the first bytes. Files are mmapped; stdin is
+// streamed through a buffer. Live objects are kept in a hash table keyed by
+// id, so ids may be sparse and as large as 64 bits.
+
+#define TRACE_MAGIC "UGTR1\n"
+#define TRACE_MAGIC_LEN 6
+#define TRACE_BUFFER (1024 * 1024)
+#define TRACE_MAX_RECORD 32     // longest binary event
+#define TRACE_SAMPLE_OPS 65536  // events between RSS samples
+#define TRACE_SLAB_MAX 32768    // the slab allocator's largest size class
+
+enum trace_allocator { TRACE_MALLOC, TRACE_MMAP, TRACE_SLAB, TRACE_ARENA, NUM_TRACE_ALLOCATORS };
+
+const char *trace_allocator_names[NUM_TRACE_ALLOCATORS] = { "malloc", "mmap", "slab", "arena" };
+
+typedef struct TraceReader {
+    const unsigned char *pos, *end;
+    unsigned char *buf;         // stdin buffer; NULL when the file is mapped
+    void *map;
+    size_t map_len;
+    int fd, eof, binary;
+    size_t line;
+} TraceReader;
+
+typedef struct TraceEvent {
+    int op;
+    uint64_t id, size;
+} TraceEvent;
+
+typedef struct TraceObject {
+    uint64_t id;
+    void *ptr;                  // NULL marks an empty slot
+    size_t size;
+} TraceObject;
+
+// Live trace objects, open addressing on the id like the block table.
+typedef struct TraceTable {
+    TraceObject *slots;
+    size_t num_slots;           // always a power of two
+    size_t used;
+} TraceTable;
+
+size_t trace_mapped;            // bytes of objects mmapped one by one
+
+size_t hash_trace_id(uint64_t id) {
+    return hash_pointer((const void *)(uintptr_t)id);
+}
+
+// Returns the slot holding id, or the empty slot where it would go.
+size_t trace_find(const TraceTable *t, uint64_t id) {
+    size_t mask = t->num_slots - 1;
+    size_t i = hash_trace_id(id) & mask;
+    while (t->slots[i].ptr != NULL && t->slots[i].id != id) i = (i + 1) & mask;
+    return i;
+}
+
+void trace_grow(TraceTable *t) {
+    TraceObject *old = t->slots;
+    size_t old_slots = t->num_slots;
+
+    t->num_slots = old_slots ? old_slots * 2 : INITIAL_SLOTS;
+    t->slots = calloc(t->num_slots, sizeof *t->slots);
+    if (t->slots == NULL) {
+        perror("Failed to allocate memory for trace objects");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_slots; ++i) {
+        if (old[i].ptr != NULL) t->slots[trace_find(t, old[i].id)] = old[i];
+    }
+    free(old);
+}
+
+// Empty slot i, shifting back later entries of its probe run (see
+// delete_slot).
+void trace_delete(TraceTable *t, size_t i) {
+    size_t mask = t->num_slots - 1;
+    size_t j = i;
+
+    t->slots[i].ptr = NULL;
+    t->used--;
+    while (1) {
+        j = (j + 1) & mask;
+        if (t->slots[j].ptr == NULL) return;
+        size_t home = hash_trace_id(t->slots[j].id) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->slots[i] = t->slots[j];
+            t->slots[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+int trace_open(TraceReader *r, const char *path) {
+    memset(r, 0, sizeof *r);
+    r->line = 1;
+    r->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (r->fd < 0) return -1;
+
+    struct stat st;
+    if (r->fd != STDIN_FILENO && fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if (r->map == MAP_FAILED) return -1;
+        madvise(r->map, st.st_size, MADV_SEQUENTIAL);
+        r->map_len = st.st_size;
+        r->pos = r->map;
+        r->end = r->pos + st.st_size;
+        r->eof = 1;
+    } else {
+        if ((r->buf = malloc(TRACE_BUFFER)) == NULL) return -1;
+        r->pos = r->end = r->buf;
+    }
+    return 0;
+}
+
+// Make at least want bytes available unless the input ends first.
+size_t trace_fill(TraceReader *r, size_t want) {
+    while ((size_t)(r->end - r->pos) < want && !r->eof) {
+        size_t have = r->end - r->pos;
+        memmove(r->buf, r->pos, have);
+        r->pos = r->buf;
+        r->end = r->buf + have;
+        ssize_t n = read(r->fd, r->buf + have, TRACE_BUFFER - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = 1;
+        else r->end += n;
+    }
+    return r->end - r->pos;
+}
+
+void trace_close(TraceReader *r) {
+    if (r->map) munmap(r->map, r->map_len);
+    free(r->buf);
+    if (r->fd > STDIN_FILENO) close(r->fd);
+}
+
+int read_varint(TraceReader *r, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && r->pos < r->end; shift += 7) {
+        unsigned char byte = *r->pos++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+void write_varint(FILE *out, uint64_t value) {
+    while (value >= 0x80) {
+        putc((value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc(value, out);
+}
+
+uint64_t parse_number(const unsigned char **p, const unsigned char *end, int *ok) {
+    uint64_t value = 0;
+    while (*p < end && (**p == ' ' || **p == '\t')) ++*p;
+    if (*p == end || **p < '0' || **p > '9') *ok = 0;
+    while (*p < end && **p >= '0' && **p <= '9') value = value * 10 + (*(*p)++ - '0');
+    return value;
+}
+
+// Read the next event. Returns 1, 0 at the end of the trace, or -1 on a
+// malformed event.
+int trace_next(TraceReader *r, TraceEvent *ev) {
+    if (r->binary) {
+        if (trace_fill(r, TRACE_MAX_RECORD) == 0) return 0;
+        ev->op = *r->pos++;
+        ev->size = 0;
+        if (read_varint(r, &ev->id) != 0) return -1;
+        if (ev->op == 'a' && read_varint(r, &ev->size) != 0) return -1;
+        return ev->op == 'a' || ev->op == 'f' || ev->op == 't' ? 1 : -1;
+    }
+    while (1) {
+        const unsigned char *nl;
+        while ((nl = memchr(r->pos, '\n', r->end - r->pos)) == NULL && !r->eof) {
+            if ((size_t)(r->end - r->pos) == TRACE_BUFFER) return -1;   // line too long
+            trace_fill(r, r->end - r->pos + 1);
+        }
+        if (r->pos == r->end) return 0;
+        const unsigned char *p = r->pos;
+        const unsigned char *end = nl ? nl : r->end;
+        r->pos = nl ? nl + 1 : r->end;
+        r->line++;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+        if (p == end || *p == '#') continue;
+
+        int ok = 1;
+        ev->op = *p++;
+        ev->id = parse_number(&p, end, &ok);
+        ev->size = ev->op == 'a' ? parse_number(&p, end, &ok) : 0;
+        if (!ok || (ev->op != 'a' && ev->op != 'f' && ev->op != 't')) {
+            r->line--;
+            return -1;
+        }
+        return 1;
+    }
+}
+
+// Slab size classes are powers of two from 16 bytes, in slabs 1 and up.
+int trace_slab_id(size_t size) {
+    int id = 1;
+    for (size_t class_size = 16; class_size < size; class_size *= 2) ++id;
+    return id;
+}
+
+void *trace_alloc(int allocator, Arena *arena, size_t size) {
+    if (size == 0) size = 1;
+    if (allocator == TRACE_MALLOC) return malloc(size);
+    if (allocator == TRACE_ARENA) return arena_alloc(arena, size);
+    if (allocator == TRACE_SLAB && size <= TRACE_SLAB_MAX) return slab_alloc(trace_slab_id(size));
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+    trace_mapped += (size + 4095) & ~(size_t)4095;
+    return ptr;
+}
+
+void trace_free(int allocator, void *ptr, size_t size) {
+    if (size == 0) size = 1;
+    if (allocator == TRACE_MALLOC) free(ptr);
+    else if (allocator == TRACE_ARENA) return;  // an arena only frees in bulk
+    else if (allocator == TRACE_SLAB && size <= TRACE_SLAB_MAX) slab_free(trace_slab_id(size), ptr);
+    else {
+        munmap(ptr, size);
+        trace_mapped -= (size + 4095) & ~(size_t)4095;
+    }
+}
+
+// Bytes the allocator holds from the system, whether touched or not.
+size_t trace_footprint(int allocator, Arena *arena) {
+    if (allocator == TRACE_MALLOC) {
+        struct mallinfo2 mi = mallinfo2();
+        return mi.arena + mi.hblkhd;
+    }
+    if (allocator == TRACE_ARENA) return arena_mapped(arena);
+    size_t bytes = trace_mapped;
+    for (int id = 1; allocator == TRACE_SLAB && id < MAX_SLABS; ++id) {
+        if (slabs[id] != NULL) bytes += slabs[id]->num_pages * slabs[id]->page_bytes;
+    }
+    return bytes;
+}
+
+// Replay a trace with no per-event output and report throughput, peak RSS
+// and fragmentation: the share of the allocator's footprint (memory held
+// from the system) that is not live bytes, at the end and at the peak.
+// With out_path, the events are also written out as a binary trace. Returns 0, or -1 if the trace could not be read.
+int replay_trace(const char *path, int allocator, const char *out_path) {
+    TraceReader r;
+    TraceEvent ev;
+    TraceTable objects = { NULL, 0, 0 };
+    Arena *arena = NULL;
+    FILE *out = NULL;
+    uint64_t counts[3] = { 0 }, bad = 0, events = 0;
+    size_t live = 0, peak_live = 0, peak_rss = 0, peak_footprint = 0, page = sysconf(_SC_PAGESIZE);
+    int rc;
+
+    if (trace_open(&r, path) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (trace_fill(&r, TRACE_MAGIC_LEN) >= TRACE_MAGIC_LEN && memcmp(r.pos, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+        r.binary = 1;
+        r.pos += TRACE_MAGIC_LEN;
+    }
+    if (out_path != NULL) {
+        if ((out = fopen(out_path, "wb")) == NULL) {
+            perror(out_path);
+            trace_close(&r);
+            return -1;
+        }
+        fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, out);
+    }
+    if (allocator == TRACE_ARENA && (arena = arena_create(MB_TO_BYTES(ARENA_CHUNK_MB))) == NULL) {
+        perror("arena_create");
+        return -1;
+    }
+    if (allocator == TRACE_SLAB) {
+        for (int id = 1; id <= trace_slab_id(TRACE_SLAB_MAX); ++id) {
+            if ((slabs[id] = slab_create((size_t)16 << (id - 1))) == NULL) {
+                perror("slab_create");
+                return -1;
+            }
+        }
+    }
+
+    trace_grow(&objects);
+    size_t base_rss = current_rss();
+    double t0 = now_ms();
+    while ((rc = trace_next(&r, &ev)) > 0) {
+        events++;
+        if (out != NULL) {
+            putc(ev.op, out);
+            write_varint(out, ev.id);
+            if (ev.op == 'a') write_varint(out, ev.size);
+        }
+        // keep the load factor at or below 1/2 so probe runs stay short
+        if (ev.op == 'a' && (objects.used + 1) * 2 > objects.num_slots) trace_grow(&objects);
+        size_t slot = trace_find(&objects, ev.id);
+        TraceObject *obj = &objects.slots[slot];
+        if (ev.op == 'a') {
+            if (obj->ptr != NULL || (obj->ptr = trace_alloc(allocator, arena, ev.size)) == NULL) {
+                bad++;
+                continue;
+            }
+            obj->id = ev.id;
+            obj->size = ev.size;
+            objects.used++;
+            live += ev.size;
+            if (live > peak_live) peak_live = live;
+            counts[0]++;
+        } else if (obj->ptr == NULL) {
+            bad++;
+            continue;
+        } else if (ev.op == 'f') {
+            trace_free(allocator, obj->ptr, obj->size);
+            live -= obj->size;
+            trace_delete(&objects, slot);
+            counts[1]++;
+        } else {
+            // write one byte per page, as a first use of the memory would
+            for (size_t off = 0; off < obj->size; off += page) ((volatile char *)obj->ptr)[off] = 1;
+            counts[2]++;
+        }
+        if (events % TRACE_SAMPLE_OPS == 0) {
+            size_t rss = current_rss();
+            size_t footprint = trace_footprint(allocator, arena);
+            if (rss > peak_rss) peak_rss = rss;
+            if (footprint > peak_footprint) peak_footprint = footprint;
+        }
+    }
+    double secs = (now_ms() - t0) / 1e3;
+    size_t end_rss = current_rss();
+    size_t end_footprint = trace_footprint(allocator, arena);
+    if (end_rss > peak_rss) peak_rss = end_rss;
+    if (end_footprint > peak_footprint) peak_footprint = end_footprint;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    if (rc < 0) {
+        if (r.binary) fprintf(stderr, "%s: malformed binary event after %llu events\n", path, (unsigned long long)events);
+        else fprintf(stderr, "%s:%zu: malformed event\n", path, r.line);
+    }
+    printf("Replayed %llu events from %s (%s trace) with %s in %.3f s: %.0f events/s\n",
+           (unsigned long long)events, path, r.binary ? "binary" : "text", trace_allocator_names[allocator], secs,
+           secs > 0 ? events / secs : 0.0);
+    printf("  %llu allocs, %llu frees, %llu touches, %llu skipped (double alloc, unknown id or failed)\n",
+           (unsigned long long)counts[0], (unsigned long long)counts[1], (unsigned long long)counts[2],
+           (unsigned long long)bad);
+    printf("  live: peak %.1f MB, end %.1f MB\n", peak_live / 1048576.0, live / 1048576.0);
+    printf("  RSS: peak %.1f MB (sampled), %.1f MB max resident, end %.1f MB, %.1f MB before replay\n",
+           peak_rss / 1048576.0, ru.ru_maxrss / 1024.0, end_rss / 1048576.0, base_rss / 1048576.0);
+    printf("  footprint: peak %.1f MB (sampled), end %.1f MB\n", peak_footprint / 1048576.0,
+           end_footprint / 1048576.0);
+    if (end_footprint > 0 && peak_footprint > 0) {
+        printf("  fragmentation: %.1f%% at end, %.1f%% at peak\n", 100.0 * (1.0 - (double)live / end_footprint),
+               100.0 * (1.0 - (double)peak_live / peak_footprint));
+    }
+
+    if (out != NULL && fclose(out) != 0) perror(out_path);
+    for (size_t i = 0; i < objects.num_slots; ++i) {
+        if (objects.slots[i].ptr != NULL) trace_free(allocator, objects.slots[i].ptr, objects.slots[i].size);
+    }
+    free(objects.slots);
+    if (arena) arena_destroy(arena);
+    trace_close(&r);
+    return rc < 0 ? -1 : 0;
+}
+
+// prefault [threads] [memset|page|populate] [bind|nobind]: words may come in
+// any order; with none, print the current settings.
+void set_prefault() {
+    char word[16];
+    int threads = touch_threads, mode = touch_mode, bind = touch_bind;
+
+    while (read_optional_word(word, sizeof word), word[0] != '\0') {
+        int m;
+        for (m = 0; m < NUM_TOUCH_MODES && strcmp(word, touch_names[m]) != 0; ++m);
+        if (m < NUM_TOUCH_MODES) mode = m;
+        else if (strcmp(word, "bind") == 0) bind = 1;
+        else if (strcmp(word, "nobind") == 0) bind = 0;
+        else if ((threads = atoi(word)) < 1 || threads > MAX_TOUCH_THREADS) {
+            printf("Usage: prefault [1-%d] [memset|page|populate] [bind|nobind]\n", MAX_TOUCH_THREADS);
+            // drop the rest of the line
+            int ch;
+            while ((ch = getchar()) != EOF && ch != '\n');
+            return;
+        }
+    }
+    touch_threads = threads;
+    touch_mode = mode;
+    touch_bind = bind;
+    printf("Prefault: %d thread%s, %s%s\n", touch_threads, touch_threads == 1 ? "" : "s",
+           touch_names[touch_mode], touch_bind ? ", bound to CPUs" : "");
+}
+
+int main(int argc, char *argv[]) {
     char command[50];
     size_t size_mb;
-    void *ptr;
+    const char *trace = NULL, *out = NULL;
+    int allocator = TRACE_MALLOC;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:a:o:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            trace = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'a':
+            for (allocator = 0; allocator < NUM_TRACE_ALLOCATORS; ++allocator) {
+                if (strcmp(optarg, trace_allocator_names[allocator]) == 0) break;
+            }
+            if (allocator < NUM_TRACE_ALLOCATORS) break;
+            // fall through
+        default:
+            fprintf(stderr, "Usage: %s [-r trace|- [-a malloc|mmap|slab|arena] [-o binary_trace]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // block records come from slab 0 rather than one malloc each
+    if ((slabs[0] = slab_create(sizeof(MemoryBlock))) == NULL) {
+        perror("Failed to allocate memory for tracking structure");
+        exit(EXIT_FAILURE);
+    }
+    if (trace != NULL) {
+        int rc = replay_trace(trace, allocator, out);
+        free_allocators();
+        return rc == 0 ? 0 : EXIT_FAILURE;
+    }
 
     printf("UniGib Interactive Memory Allocator (MB)\n");
-    printf("Commands: allocate <MB>, free <address>, list, quit\n");
+    printf("Commands: allocate <MB> [malloc|mmap|populate|thp|hugetlb], free <address>, list [all],\n"
+           "          prefault [threads] [memset|page|populate] [bind|nobind],\n"
+           "          arena [new [chunk_MB] | alloc <id> <count> <size> | reset <id> | destroy <id>],\n"
+           "          slab [new <objsize> | alloc <id> <count> | free <id> <count> | destroy <id>],\n"
+           "          bench [objsize] [count] [threads], quit\n");
 
     while (1) {
         printf("> ");
-        if (scanf("%s", command) != 1) continue;
+        if (scanf("%49s", command) != 1) {
+            if (feof(stdin)) {
+                free_all_blocks();
+                free_allocators();
+                break;
+            }
+            continue;
+        }
 
         if (strcmp(command, "allocate") == 0) {
+            char name[16];
+            int backend = BACKEND_MALLOC;
             if (scanf("%zu", &size_mb) != 1) {
-                printf("Invalid size. Usage: allocate <MB>\n");
+                printf("Invalid size. Usage: allocate <MB> [backend]\n");
                 continue;
             }
-            size_t size_bytes = MB_TO_BYTES(size_mb);
-            ptr = malloc(size_bytes); // Allocate memory
-            if (ptr == NULL) {
-                perror("Memory allocation failed");
-            } else {
-                add_block(ptr, size_mb);
-		memset(ptr, 1, size_bytes);
-                printf("Allocated %zu MB at address %p\n", size_mb, ptr);
+            read_optional_word(name, sizeof name);
+            if (name[0] != '\0') {
+                for (backend = 0; backend < NUM_BACKENDS; ++backend) {
+                    if (strcmp(name, backend_names[backend]) == 0) break;
+                }
+                if (backend == NUM_BACKENDS) {
+                    printf("Unknown backend. Use malloc, mmap, populate, thp or hugetlb.\n");
+                    continue;
+                }
             }
+            allocate_block(size_mb, backend);
         } else if (strcmp(command, "free") == 0) {
             unsigned long address_val;
             if (scanf("%lx", &address_val) != 1) { // Read address as hex
@@ -115,15 +1479,26 @@ int main() {
             void *address_ptr = (void *)address_val;
             remove_block(address_ptr);
         } else if (strcmp(command, "list") == 0) {
-            print_blocks();
+            // optional "all" on the same line forces the full listing
+            char arg[8];
+            read_optional_word(arg, sizeof arg);
+            print_blocks(strcmp(arg, "all") == 0);
+        } else if (strcmp(command, "arena") == 0) {
+            arena_command();
+        } else if (strcmp(command, "slab") == 0) {
+            slab_command();
+        } else if (strcmp(command, "bench") == 0) {
+            bench_command();
+        } else if (strcmp(command, "prefault") == 0) {
+            set_prefault();
         } else if (strcmp(command, "quit") == 0) {
             free_all_blocks();
+            free_allocators();
             break;
         } else {
-            printf("Unknown command. Use 'allocate', 'free', 'list', or 'quit'.\n");
+            printf("Unknown command. Use 'allocate', 'free', 'list', 'prefault', 'arena', 'slab', 'bench', or 'quit'.\n");
         }
     }
 
     return 0;
 }
-
@@ -0,0 +1,205 @@
+// perf-counters.h
+// Per-thread hardware and software event counters on perf_event_open,
+// header only. Counts cycles, instructions, cache misses, branch misses,
+// page faults and context switches over a measured region of the calling
+// thread, so a benchmark can say why a number moved, not just that it did.
+//
+// Counters that cannot be opened (no PMU in a VM or container, seccomp,
+// perf_event_paranoid) are left out and reported as "-" or null; the rest
+// still work. If the kernel refuses to count kernel-mode events the open is
+// retried for user mode only. Counts are scaled by time_enabled/time_running
+// when the kernel has to multiplex them.
+//
+// Usage:
+//   struct perf_counters pc;
+//   perf_open(&pc);               // in the thread to be measured
+//   perf_start(&pc);
+//   ... measured region ...
+//   perf_stop(&pc);
+//   perf_print(&pc, stdout);
+//   perf_close(&pc);
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_NUM_COUNTERS
+};
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_NUM_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+struct perf_counters {
+    int fd[PERF_NUM_COUNTERS];          // -1 when unavailable
+    uint64_t value[PERF_NUM_COUNTERS];
+    int available;                      // bitmask of counters that opened
+    int user_only;                      // bitmask of those limited to user mode
+    int error;                          // errno of the first counter that failed
+};
+
+// Open every counter for the calling thread, disabled. Returns how many
+// opened; a zero-initialised perf_counters that was never opened, or one
+// with none available, is harmless to start, stop and print.
+static inline int perf_open(struct perf_counters *pc) {
+    int n = 0;
+    memset(pc, 0, sizeof *pc);
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (pc->fd[i] < 0 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if (pc->fd[i] >= 0) pc->user_only |= 1 << i;
+        }
+        if (pc->fd[i] < 0) {
+            if (pc->error == 0) pc->error = errno;
+            continue;
+        }
+        pc->available |= 1 << i;
+        n++;
+    }
+    return n;
+}
+
+static inline void perf_start(struct perf_counters *pc) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (!(pc->available & (1 << i)) || pc->fd[i] < 0) continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static inline void perf_stop(struct perf_counters *pc) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if ((pc->available & (1 << i)) && pc->fd[i] >= 0) ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        uint64_t buf[3];                // value, time enabled, time running
+        if (!(pc->available & (1 << i)) || pc->fd[i] < 0) continue;
+        pc->value[i] = 0;
+        if (read(pc->fd[i], buf, sizeof buf) != sizeof buf) continue;
+        pc->value[i] = buf[2] > 0 && buf[2] < buf[1] ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+    }
+}
+
+// Release the counters; the last values stay readable for printing.
+static inline void perf_close(struct perf_counters *pc) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->fd[i] >= 0 && (pc->available & (1 << i))) close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+// Add src's counts into dst, e.g. to total per-thread counters. A counter
+// is only available in the total if it was in every part.
+static inline void perf_sum(struct perf_counters *dst, const struct perf_counters *src, int first) {
+    if (first) {
+        *dst = *src;
+        return;
+    }
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) dst->value[i] += src->value[i];
+    dst->available &= src->available;
+    dst->user_only |= src->user_only;
+    if (dst->error == 0) dst->error = src->error;
+}
+
+static inline double perf_ipc(const struct perf_counters *pc) {
+    int need = (1 << PERF_CYCLES) | (1 << PERF_INSTRUCTIONS);
+    if ((pc->available & need) != need || pc->value[PERF_CYCLES] == 0) return -1;
+    return (double)pc->value[PERF_INSTRUCTIONS] / pc->value[PERF_CYCLES];
+}
+
+// Short human-readable form, e.g. " ipc 2.41 cyc 3.1G ins 7.5G cmiss 12.0K
+// bmiss 301 pf 0 cs 2", with "-" for counters that are unavailable.
+static inline void perf_print(const struct perf_counters *pc, FILE *out) {
+    static const char *labels[PERF_NUM_COUNTERS] = { "cyc", "ins", "cmiss", "bmiss", "pf", "cs" };
+    double ipc = perf_ipc(pc);
+    if (ipc < 0) fprintf(out, " ipc -");
+    else fprintf(out, " ipc %.2f", ipc);
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        double v = (double)pc->value[i];
+        if (!(pc->available & (1 << i))) fprintf(out, " %s -", labels[i]);
+        else if (v >= 1e9) fprintf(out, " %s %.1fG", labels[i], v / 1e9);
+        else if (v >= 1e6) fprintf(out, " %s %.1fM", labels[i], v / 1e6);
+        else if (v >= 1e4) fprintf(out, " %s %.1fK", labels[i], v / 1e3);
+        else fprintf(out, " %s %.0f", labels[i], v);
+    }
+}
+
+// As a JSON object; unavailable counters are null.
+static inline void perf_print_json(const struct perf_counters *pc, FILE *out) {
+    double ipc = perf_ipc(pc);
+    if (ipc < 0) fprintf(out, "{\"ipc\": null");
+    else fprintf(out, "{\"ipc\": %.3f", ipc);
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->available & (1 << i)) fprintf(out, ", \"%s\": %llu", perf_events[i].name, (unsigned long long)pc->value[i]);
+        else fprintf(out, ", \"%s\": null", perf_events[i].name);
+    }
+    fprintf(out, "}");
+}
+
+// CSV columns: perf_print_csv_header() once, then perf_print_csv() per row.
+// Both start with a comma; the column names are prefixed with prefix, and
+// unavailable counters are empty fields.
+static inline void perf_print_csv_header(FILE *out, const char *prefix) {
+    fprintf(out, ",%sipc", prefix);
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) fprintf(out, ",%s%s", prefix, perf_events[i].name);
+}
+
+static inline void perf_print_csv(const struct perf_counters *pc, FILE *out) {
+    double ipc = perf_ipc(pc);
+    if (ipc < 0) fprintf(out, ",");
+    else fprintf(out, ",%.3f", ipc);
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->available & (1 << i)) fprintf(out, ",%llu", (unsigned long long)pc->value[i]);
+        else fprintf(out, ",");
+    }
+}
+
+// One line for stderr saying which counters are missing and why, or
+// nothing when all of them are there.
+static inline void perf_report_missing(const struct perf_counters *pc, FILE *out) {
+    int all = (1 << PERF_NUM_COUNTERS) - 1;
+    if (pc->available != all) {
+        fprintf(out, "perf counters unavailable:");
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+            if (!(pc->available & (1 << i))) fprintf(out, " %s", perf_events[i].name);
+        }
+        fprintf(out, " (%s)\n", pc->error ? strerror(pc->error) : "not opened");
+    }
+    if (pc->user_only) fprintf(out, "perf counters count user mode only (perf_event_paranoid)\n");
+}
+
+#endif
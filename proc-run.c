@@ -1,37 +1,653 @@
-    #include <stdio.h>
-    #include <time.h>
-    #include <sys/time.h> // For gettimeofday
+// proc-run.c
+// UniGib Processors Tester: multi-core CPU benchmark over a set of kernels
+// Compile: gcc -Wall -O2 -pthread -o proc-run proc-run.c
+// Run: ./proc-run [-k kernels] [-t threads,...] [-d secs] [-w warmup_secs] [-r reps] [-I avx512|avx2|sse2] [-P] [-j]
+//      ./proc-run -L [-t threads] [-i interval_us] [-a] [-p fifo_priority] [-l load_threads] [-k kernel] [-d secs] [-j]
+//
+// Kernels (-k, comma separated, all by default):
+//   int       four independent 64-bit multiply-add chains
+//   fp-chain  one dependent x = x * a + b chain: FP latency
+//   fp-tput   eight independent scalar chains: FP throughput
+//   simd-fma  eight independent vector FMA chains, AVX-512 or AVX2 picked at
+//             runtime (-I forces one); SSE2 multiply + add as a fallback
+//   branchy   two unpredictable, data-dependent branches per iteration
+//
+// For each kernel and thread count (-t, default 1, 2, 4, ... up to the CPU
+// count) the threads are pinned to CPUs, run a warmup, then reps timed
+// runs of a fixed duration, started together. Timing uses CLOCK_MONOTONIC.
+// The median run is reported as ops/sec per core and in total, with the
+// scaling efficiency against the single-thread rate, as a table or as
+// JSON with -j. -P adds hardware counters (perf-counters.h) for the median
+// run, summed over its threads, next to each result.
+//
+// -L measures scheduler wake-up latency instead, in the manner of
+// cyclictest. Each of -t threads (default one per CPU) sleeps to absolute
+// deadlines every interval_us (default 1000) for -d seconds (default 10)
+// and records how late it woke into a histogram (hdr-hist.h). -a pins
+// thread i to the i-th allowed CPU, -p runs them SCHED_FIFO at the given
+// priority where permitted, and -l starts that many background threads
+// running the first kernel of -k (pinned the same way with -a) to create
+// contention. The report gives min, mean, p99, p99.99 and max lateness
+// per thread and CPU, and over all threads.
 
-    int main() {
-        struct timeval start_time, end_time;
-        long long iterations = 100000000; // Number of loop iterations
-	double result=0.0;
-	long long i;
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "hdr-hist.h"
+#include "perf-counters.h"
 
-	while(1)
-	{
-        gettimeofday(&start_time, NULL); // Start timing
+#define MAX_THREADS 256
+#define MAX_REPS 64
+#define CHUNK 65536             // iterations between clock checks
 
-        for (long long i = 0; i < iterations; i++) {
-            // Code to be benchmarked
-            // Example: a simple arithmetic operation
-            volatile int temp = i * 2; 
+struct kernel {
+    const char *name;
+    const char *unit;           // what one op is
+    double ops_per_iter;
+    uint64_t (*fn)(uint64_t iters);
+};
+
+// Results are folded in here so the compiler cannot drop the work, and
+// the FP chains start from seed so it cannot fold them to a constant.
+volatile uint64_t sink;
+volatile double seed = 1.5;
+
+uint64_t int_kernel(uint64_t iters) {
+    uint64_t a = 1, b = 2, c = 3, d = 4;
+    for (uint64_t i = 0; i < iters; ++i) {
+        a = a * 6364136223846793005ULL + 1442695040888963407ULL;
+        b = b * 2862933555777941757ULL + 3037000493ULL;
+        c = c * 3202034522624059733ULL + 4354685564936845319ULL;
+        d = d * 2685821657736338717ULL + 1ULL;
+    }
+    return a ^ b ^ c ^ d;
+}
+
+uint64_t fp_chain_kernel(uint64_t iters) {
+    double x = seed;
+    for (uint64_t i = 0; i < iters; ++i) x = x * 0.999999999 + 1e-9;
+    return (uint64_t)(x * 1e6);
+}
+
+// Kept scalar on purpose; the vector units are simd-fma's job.
+__attribute__((optimize("no-tree-vectorize"))) uint64_t fp_tput_kernel(uint64_t iters) {
+    double x0 = seed, x1 = x0 + 1, x2 = x0 + 2, x3 = x0 + 3, x4 = x0 + 4, x5 = x0 + 5, x6 = x0 + 6, x7 = x0 + 7;
+    for (uint64_t i = 0; i < iters; ++i) {
+        x0 = x0 * 0.999999999 + 1e-9;
+        x1 = x1 * 0.999999999 + 1e-9;
+        x2 = x2 * 0.999999999 + 1e-9;
+        x3 = x3 * 0.999999999 + 1e-9;
+        x4 = x4 * 0.999999999 + 1e-9;
+        x5 = x5 * 0.999999999 + 1e-9;
+        x6 = x6 * 0.999999999 + 1e-9;
+        x7 = x7 * 0.999999999 + 1e-9;
+    }
+    return (uint64_t)((x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7) * 1e6);
+}
+
+uint64_t branchy_kernel(uint64_t iters) {
+    uint64_t x = 88172645463325252ULL, acc = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        // the empty asm keeps these as real branches rather than cmovs
+        if (x & 1) {
+            __asm__ volatile("");
+            acc += x >> 32;
+        } else {
+            acc -= 3;
+        }
+        if (x & 0x100) {
+            __asm__ volatile("");
+            acc ^= i;
         }
-	
+    }
+    return acc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-	for (i = 0; i < 1000000000; i++) { // 1 billion iterations
-		result += (double)i / 3.1415926535; // Example floating-point operation
-		result *= 1.000000001; // Another operation
-    	}
+// Eight accumulators cover the FMA latency on two ports.
+__attribute__((target("avx512f"))) uint64_t fma_avx512_kernel(uint64_t iters) {
+    __m512d m = _mm512_set1_pd(0.999999999), a = _mm512_set1_pd(1e-9);
+    __m512d x0 = _mm512_set1_pd(seed), x1 = x0, x2 = x0, x3 = x0, x4 = x0, x5 = x0, x6 = x0, x7 = x0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        x0 = _mm512_fmadd_pd(x0, m, a);
+        x1 = _mm512_fmadd_pd(x1, m, a);
+        x2 = _mm512_fmadd_pd(x2, m, a);
+        x3 = _mm512_fmadd_pd(x3, m, a);
+        x4 = _mm512_fmadd_pd(x4, m, a);
+        x5 = _mm512_fmadd_pd(x5, m, a);
+        x6 = _mm512_fmadd_pd(x6, m, a);
+        x7 = _mm512_fmadd_pd(x7, m, a);
+    }
+    __m512d s = _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(x0, x1), _mm512_add_pd(x2, x3)),
+                              _mm512_add_pd(_mm512_add_pd(x4, x5), _mm512_add_pd(x6, x7)));
+    return (uint64_t)(_mm512_reduce_add_pd(s) * 1e6);
+}
+
+__attribute__((target("avx2,fma"))) uint64_t fma_avx2_kernel(uint64_t iters) {
+    __m256d m = _mm256_set1_pd(0.999999999), a = _mm256_set1_pd(1e-9);
+    __m256d x0 = _mm256_set1_pd(seed), x1 = x0, x2 = x0, x3 = x0, x4 = x0, x5 = x0, x6 = x0, x7 = x0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        x0 = _mm256_fmadd_pd(x0, m, a);
+        x1 = _mm256_fmadd_pd(x1, m, a);
+        x2 = _mm256_fmadd_pd(x2, m, a);
+        x3 = _mm256_fmadd_pd(x3, m, a);
+        x4 = _mm256_fmadd_pd(x4, m, a);
+        x5 = _mm256_fmadd_pd(x5, m, a);
+        x6 = _mm256_fmadd_pd(x6, m, a);
+        x7 = _mm256_fmadd_pd(x7, m, a);
+    }
+    double out[4];
+    _mm256_storeu_pd(out, _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(x0, x1), _mm256_add_pd(x2, x3)),
+                                        _mm256_add_pd(_mm256_add_pd(x4, x5), _mm256_add_pd(x6, x7))));
+    return (uint64_t)((out[0] + out[1] + out[2] + out[3]) * 1e6);
+}
+
+__attribute__((target("sse2"))) uint64_t fma_sse2_kernel(uint64_t iters) {
+    __m128d m = _mm_set1_pd(0.999999999), a = _mm_set1_pd(1e-9);
+    __m128d x0 = _mm_set1_pd(seed), x1 = x0, x2 = x0, x3 = x0, x4 = x0, x5 = x0, x6 = x0, x7 = x0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        x0 = _mm_add_pd(_mm_mul_pd(x0, m), a);
+        x1 = _mm_add_pd(_mm_mul_pd(x1, m), a);
+        x2 = _mm_add_pd(_mm_mul_pd(x2, m), a);
+        x3 = _mm_add_pd(_mm_mul_pd(x3, m), a);
+        x4 = _mm_add_pd(_mm_mul_pd(x4, m), a);
+        x5 = _mm_add_pd(_mm_mul_pd(x5, m), a);
+        x6 = _mm_add_pd(_mm_mul_pd(x6, m), a);
+        x7 = _mm_add_pd(_mm_mul_pd(x7, m), a);
+    }
+    double out[2];
+    _mm_storeu_pd(out, _mm_add_pd(_mm_add_pd(_mm_add_pd(x0, x1), _mm_add_pd(x2, x3)),
+                                  _mm_add_pd(_mm_add_pd(x4, x5), _mm_add_pd(x6, x7))));
+    return (uint64_t)((out[0] + out[1]) * 1e6);
+}
+#endif
 
-        gettimeofday(&end_time, NULL); // End timing
+// Portable stand-in for the vector kernels: the same eight chains, scalar.
+uint64_t fma_scalar_kernel(uint64_t iters) {
+    return fp_tput_kernel(iters);
+}
 
-        // Calculate and print the duration
-        double elapsed_time = (end_time.tv_sec - start_time.tv_sec) + 
-                              (double)(end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+enum { K_INT, K_FP_CHAIN, K_FP_TPUT, K_SIMD, K_BRANCHY, NUM_KERNELS };
 
-        printf("UniGib Processors Tester: %lld iterations took %.6f seconds.\n", iterations, elapsed_time);
-	}
+// simd-fma is filled in by pick_simd() once the CPU is known.
+struct kernel kernels[NUM_KERNELS] = {
+    { "int", "int ops", 8, int_kernel },
+    { "fp-chain", "flops", 2, fp_chain_kernel },
+    { "fp-tput", "flops", 16, fp_tput_kernel },
+    { "simd-fma", "flops", 16, fma_scalar_kernel },
+    { "branchy", "iterations", 1, branchy_kernel },
+};
+const char *simd_isa = "scalar";
 
+// Choose the widest vector unit available, or the one named by force.
+// Returns -1 if the forced one is not supported.
+int pick_simd(const char *force) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct {
+        const char *name;
+        int ok;
+        uint64_t (*fn)(uint64_t);
+        double flops;           // 8 chains x lanes x 2
+    } isas[] = {
+        { "avx512", __builtin_cpu_supports("avx512f"), fma_avx512_kernel, 8 * 8 * 2 },
+        { "avx2", __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"), fma_avx2_kernel, 8 * 4 * 2 },
+        { "sse2", __builtin_cpu_supports("sse2"), fma_sse2_kernel, 8 * 2 * 2 },
+    };
+    for (size_t i = 0; i < sizeof isas / sizeof isas[0]; ++i) {
+        if (force != NULL && strcmp(force, isas[i].name) != 0) continue;
+        if (!isas[i].ok) {
+            if (force != NULL) return -1;
+            continue;
+        }
+        simd_isa = isas[i].name;
+        kernels[K_SIMD].fn = isas[i].fn;
+        kernels[K_SIMD].ops_per_iter = isas[i].flops;
         return 0;
     }
+#endif
+    return force != NULL && strcmp(force, "scalar") != 0 ? -1 : 0;
+}
+
+struct worker {
+    pthread_t thread;
+    int cpu;
+    const struct kernel *kernel;
+    pthread_barrier_t *barrier;
+    double warmup, duration;
+    int reps;
+    double rate[MAX_REPS];      // ops/sec in each timed run
+    int use_perf;
+    struct perf_counters perf;
+    uint64_t counts[MAX_REPS][PERF_NUM_COUNTERS];
+};
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The i-th CPU this process may run on, wrapping around.
+int nth_allowed_cpu(int i) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0 || CPU_COUNT(&set) == 0) return -1;
+    i %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set) && i-- == 0) return cpu;
+    }
+    return -1;
+}
+
+// Run the kernel in CHUNK-iteration pieces for secs; returns iterations.
+uint64_t run_for(const struct kernel *k, double secs) {
+    uint64_t iters = 0, acc = 0;
+    double end = now_sec() + secs;
+    do {
+        acc += k->fn(CHUNK);
+        iters += CHUNK;
+    } while (now_sec() < end);
+    sink += acc;
+    return iters;
+}
+
+void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+    if (w->use_perf) perf_open(&w->perf);
+    pthread_barrier_wait(w->barrier);
+    if (w->warmup > 0) run_for(w->kernel, w->warmup);
+    for (int r = 0; r < w->reps; ++r) {
+        pthread_barrier_wait(w->barrier);
+        perf_start(&w->perf);
+        double t0 = now_sec();
+        uint64_t iters = run_for(w->kernel, w->duration);
+        double t1 = now_sec();
+        perf_stop(&w->perf);
+        w->rate[r] = iters * w->kernel->ops_per_iter / (t1 - t0);
+        memcpy(w->counts[r], w->perf.value, sizeof w->counts[r]);
+    }
+    perf_close(&w->perf);
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Per-thread rates from the median run (by total rate) of one measurement,
+// and with use_perf its counters summed over the threads into perf.
+void measure(const struct kernel *k, int nthreads, double warmup, double duration, int reps, double *per_thread,
+             int use_perf, struct perf_counters *perf) {
+    struct worker *workers = calloc(nthreads, sizeof *workers);
+    pthread_barrier_t barrier;
+
+    if (workers == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].use_perf = use_perf;
+        workers[i].cpu = nth_allowed_cpu(i);
+        workers[i].kernel = k;
+        workers[i].barrier = &barrier;
+        workers[i].warmup = warmup;
+        workers[i].duration = duration;
+        workers[i].reps = reps;
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nthreads; ++i) pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    double totals[MAX_REPS], sorted[MAX_REPS];
+    for (int r = 0; r < reps; ++r) {
+        totals[r] = 0;
+        for (int i = 0; i < nthreads; ++i) totals[r] += workers[i].rate[r];
+        sorted[r] = totals[r];
+    }
+    qsort(sorted, reps, sizeof sorted[0], compare_double);
+    int median = 0;
+    for (int r = 0; r < reps; ++r) {
+        if (totals[r] == sorted[reps / 2]) median = r;
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        per_thread[i] = workers[i].rate[median];
+        memcpy(workers[i].perf.value, workers[i].counts[median], sizeof workers[i].perf.value);
+        perf_sum(perf, &workers[i].perf, i == 0);
+    }
+    free(workers);
+}
+
+// ---- Wake-up latency (-L) ----
+
+static int stop;                // set on SIGINT/SIGTERM, and to end the load
+
+void on_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+struct waker {
+    pthread_t thread;
+    int cpu;                    // -1 when not pinned
+    int priority;               // SCHED_FIFO priority, 0 for SCHED_OTHER
+    long interval_ns;
+    double duration;
+    pthread_barrier_t *barrier;
+    int fifo;                   // SCHED_FIFO was granted
+    int last_cpu;               // where it last woke up
+    uint64_t overruns;          // whole intervals missed
+    struct hdr_hist hist;       // lateness in ns
+};
+
+struct loader {
+    pthread_t thread;
+    int cpu;
+    const struct kernel *kernel;
+};
+
+void pin_self(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+void *load_loop(void *arg) {
+    struct loader *l = arg;
+    uint64_t acc = 0;
+    pin_self(l->cpu);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) acc += l->kernel->fn(CHUNK);
+    sink += acc;
+    return NULL;
+}
+
+void timespec_add_ns(struct timespec *ts, long ns) {
+    ts->tv_nsec += ns % 1000000000L;
+    ts->tv_sec += ns / 1000000000L + ts->tv_nsec / 1000000000L;
+    ts->tv_nsec %= 1000000000L;
+}
+
+// Sleep to each deadline and record how late the wake-up was. A wake-up
+// later than a whole interval counts the deadlines it swallowed as
+// overruns and resumes on the next one still ahead.
+void *wake_loop(void *arg) {
+    struct waker *w = arg;
+    pin_self(w->cpu);
+    if (w->priority > 0) {
+        struct sched_param sp = { .sched_priority = w->priority };
+        w->fifo = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0;
+    }
+    pthread_barrier_wait(w->barrier);
+
+    struct timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    double end = now_sec() + w->duration;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        timespec_add_ns(&next, w->interval_ns);
+        int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        if (err == EINTR) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t late = (int64_t)(now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec);
+        if (late < 0) late = 0;
+        hdr_record(&w->hist, (uint64_t)late);
+        w->last_cpu = sched_getcpu();
+        if (late >= w->interval_ns) {
+            long missed = late / w->interval_ns;
+            w->overruns += missed;
+            timespec_add_ns(&next, missed * w->interval_ns);
+        }
+        if (now.tv_sec + now.tv_nsec / 1e9 >= end) break;
+    }
+    return NULL;
+}
+
+int run_latency(int nwakers, long interval_us, double duration, int pin, int priority, int nload,
+                const struct kernel *load_kernel, int json) {
+    struct waker *wakers = calloc(nwakers, sizeof *wakers);
+    struct loader *loaders = calloc(nload > 0 ? nload : 1, sizeof *loaders);
+    pthread_barrier_t barrier;
+
+    if (wakers == NULL || loaders == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    // keep page faults out of the measurement where we are allowed to
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0 && priority > 0) perror("mlockall");
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (int i = 0; i < nload; ++i) {
+        loaders[i].cpu = pin ? nth_allowed_cpu(i) : -1;
+        loaders[i].kernel = load_kernel;
+        if (pthread_create(&loaders[i].thread, NULL, load_loop, &loaders[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_init(&barrier, NULL, nwakers);
+    for (int i = 0; i < nwakers; ++i) {
+        hdr_init(&wakers[i].hist);
+        wakers[i].cpu = pin ? nth_allowed_cpu(i) : -1;
+        wakers[i].priority = priority;
+        wakers[i].interval_ns = interval_us * 1000;
+        wakers[i].duration = duration;
+        wakers[i].barrier = &barrier;
+        if (pthread_create(&wakers[i].thread, NULL, wake_loop, &wakers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nwakers; ++i) pthread_join(wakers[i].thread, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < nload; ++i) pthread_join(loaders[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    int fifo = 0;
+    struct hdr_hist *all = malloc(sizeof *all);
+    if (all == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    hdr_init(all);
+    for (int i = 0; i < nwakers; ++i) {
+        hdr_merge(all, &wakers[i].hist);
+        fifo += wakers[i].fifo;
+    }
+    if (priority > 0 && fifo < nwakers) {
+        fprintf(stderr, "SCHED_FIFO was refused for %d of %d threads; they ran SCHED_OTHER\n", nwakers - fifo, nwakers);
+    }
+
+    if (json) {
+        printf("{\"mode\": \"latency\", \"interval_us\": %ld, \"duration_s\": %g, \"pinned\": %s, "
+               "\"fifo_priority\": %d, \"load_threads\": %d, \"load_kernel\": \"%s\", \"threads\": [",
+               interval_us, duration, pin ? "true" : "false", priority, nload, load_kernel->name);
+        for (int i = 0; i < nwakers; ++i) {
+            printf("%s\n  {\"thread\": %d, \"cpu\": %d, \"pinned\": %s, \"fifo\": %s, \"overruns\": %llu, "
+                   "\"latency_us\": ", i ? "," : "", i, wakers[i].cpu >= 0 ? wakers[i].cpu : wakers[i].last_cpu,
+                   wakers[i].cpu >= 0 ? "true" : "false", wakers[i].fifo ? "true" : "false",
+                   (unsigned long long)wakers[i].overruns);
+            hdr_print_json(&wakers[i].hist, stdout, 1000.0);
+            printf("}");
+        }
+        printf("\n], \"all_us\": ");
+        hdr_print_json(all, stdout, 1000.0);
+        printf("}\n");
+    } else {
+        printf("Wake-up latency: %d threads every %ld us for %g s, %s, %s; ", nwakers, interval_us, duration,
+               pin ? "pinned" : "unpinned",
+               priority > 0 ? (fifo == nwakers ? "SCHED_FIFO" : "SCHED_FIFO where permitted") : "SCHED_OTHER");
+        if (nload > 0) printf("%d load threads running %s\n", nload, load_kernel->name);
+        else printf("no load\n");
+        printf("%6s %5s %10s %9s %9s %9s %10s %10s %9s\n", "thread", "cpu", "samples", "min us", "mean us", "p99 us",
+               "p99.99 us", "max us", "overruns");
+        for (int i = 0; i < nwakers; ++i) {
+            const struct hdr_hist *h = &wakers[i].hist;
+            char cpu[16];
+            // unpinned threads show where they last ran
+            if (wakers[i].cpu >= 0) snprintf(cpu, sizeof cpu, "%d", wakers[i].cpu);
+            else snprintf(cpu, sizeof cpu, "~%d", wakers[i].last_cpu);
+            printf("%6d %5s %10llu %9.1f %9.1f %9.1f %10.1f %10.1f %9llu\n", i, cpu, (unsigned long long)h->count,
+                   h->count ? h->min / 1e3 : 0.0, hdr_mean(h) / 1e3, hdr_percentile(h, 99) / 1e3,
+                   hdr_percentile(h, 99.99) / 1e3, h->max / 1e3, (unsigned long long)wakers[i].overruns);
+        }
+        printf("All threads:\n");
+        hdr_print(all, stdout, 1000.0, "us");
+    }
+    free(all);
+    free(wakers);
+    free(loaders);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-k kernels] [-t threads,...] [-d secs] [-w warmup_secs] [-r reps] "
+                    "[-I avx512|avx2|sse2] [-P] [-j]\n"
+                    "       %s -L [-t threads] [-i interval_us] [-a] [-p fifo_priority] [-l load_threads] [-k kernel] "
+                    "[-d secs] [-j]\n", prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int threads[MAX_THREADS], nthreads = 0;
+    unsigned selected = (1u << NUM_KERNELS) - 1;
+    double duration = 1.0, warmup = 0.5;
+    int reps = 3, json = 0, use_perf = 0;
+    int latency = 0, pin = 0, priority = 0, nload = 0, duration_set = 0;
+    long interval_us = 1000;
+    const char *force_isa = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:t:d:w:r:I:PjLi:ap:l:h")) != -1) {
+        switch (opt) {
+        case 'k':
+            selected = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int k;
+                for (k = 0; k < NUM_KERNELS && strcmp(tok, kernels[k].name) != 0; ++k);
+                if (k == NUM_KERNELS) usage(argv[0]);
+                selected |= 1u << k;
+            }
+            break;
+        case 't':
+            for (char *tok = strtok(optarg, ","); tok != NULL && nthreads < MAX_THREADS; tok = strtok(NULL, ",")) {
+                threads[nthreads] = atoi(tok);
+                if (threads[nthreads] < 1 || threads[nthreads] > MAX_THREADS) usage(argv[0]);
+                nthreads++;
+            }
+            break;
+        case 'd': duration = atof(optarg); duration_set = 1; break;
+        case 'w': warmup = atof(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        case 'I': force_isa = optarg; break;
+        case 'P': use_perf = 1; break;
+        case 'j': json = 1; break;
+        case 'L': latency = 1; break;
+        case 'i': interval_us = atol(optarg); break;
+        case 'a': pin = 1; break;
+        case 'p': priority = atoi(optarg); break;
+        case 'l': nload = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (duration <= 0 || warmup < 0 || reps < 1 || reps > MAX_REPS || selected == 0) usage(argv[0]);
+    if (pick_simd(force_isa) != 0) {
+        fprintf(stderr, "This CPU does not support %s.\n", force_isa);
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : 1;
+    if (latency) {
+        int k = 0;
+        while (!(selected & (1u << k))) k++;
+        if (interval_us < 1 || priority < 0 || priority > 99 || nload < 0) usage(argv[0]);
+        return run_latency(nthreads ? threads[0] : (cpus < MAX_THREADS ? cpus : MAX_THREADS), interval_us,
+                           duration_set ? duration : 10.0, pin, priority, nload, &kernels[k], json);
+    }
+    if (nthreads == 0) {
+        int max = cpus < MAX_THREADS ? cpus : MAX_THREADS;
+        for (int t = 1; t < max; t *= 2) threads[nthreads++] = t;
+        threads[nthreads++] = max;
+    }
+    if (use_perf) {
+        struct perf_counters probe;
+        perf_open(&probe);
+        perf_report_missing(&probe, stderr);
+        perf_close(&probe);
+    }
+    char host[256] = "unknown";
+    gethostname(host, sizeof host);
+
+    if (json) {
+        printf("{\"host\": \"%s\", \"cpus\": %d, \"simd\": \"%s\", \"duration_s\": %g, \"warmup_s\": %g, "
+               "\"reps\": %d, \"kernels\": [", host, cpus, simd_isa, duration, warmup, reps);
+    } else {
+        printf("UniGib Processors Tester: %s, %d CPUs, simd-fma uses %s; median of %d x %g s runs after %g s warmup\n",
+               host, cpus, simd_isa, reps, duration, warmup);
+        printf("%-9s %7s %16s %16s %10s  %s\n", "kernel", "threads", "per core Mops/s", "total Mops/s", "efficiency",
+               use_perf ? "unit       counters (all threads)" : "unit");
+    }
+    const char *ksep = "";
+    for (int k = 0; k < NUM_KERNELS; ++k) {
+        if (!(selected & (1u << k))) continue;
+        double single = 0;
+        if (json) printf("%s\n  {\"name\": \"%s\", \"unit\": \"%s\", \"runs\": [", ksep, kernels[k].name, kernels[k].unit);
+        ksep = ",";
+        for (int t = 0; t < nthreads; ++t) {
+            double per_thread[MAX_THREADS], total = 0;
+            struct perf_counters perf;
+            measure(&kernels[k], threads[t], warmup, duration, reps, per_thread, use_perf, &perf);
+            for (int i = 0; i < threads[t]; ++i) total += per_thread[i];
+            double per_core = total / threads[t];
+            // efficiency: per-core rate against the first (normally 1-thread) run
+            if (t == 0) single = per_core;
+            double efficiency = single > 0 ? per_core / single : 0;
+            if (json) {
+                printf("%s\n    {\"threads\": %d, \"per_core\": %.0f, \"total\": %.0f, \"efficiency\": %.4f, "
+                       "\"per_thread\": [", t ? "," : "", threads[t], per_core, total, efficiency);
+                for (int i = 0; i < threads[t]; ++i) printf("%s%.0f", i ? ", " : "", per_thread[i]);
+                printf("]");
+                if (use_perf) {
+                    printf(", \"counters\": ");
+                    perf_print_json(&perf, stdout);
+                }
+                printf("}");
+            } else {
+                printf("%-9s %7d %16.1f %16.1f %9.1f%%  %-*s", kernels[k].name, threads[t], per_core / 1e6,
+                       total / 1e6, efficiency * 100, use_perf ? 10 : 0, kernels[k].unit);
+                if (use_perf) perf_print(&perf, stdout);
+                printf("\n");
+            }
+            fflush(stdout);
+        }
+        if (json) printf("\n  ]}");
+    }
+    if (json) printf("\n]}\n");
+
+    return 0;
+}
@@ -1,59 +1,296 @@
+// server.c
+// Request/response server: every request line gets "Hello from server\n"
+// Compile: gcc -Wall -O2 -pthread -o server server.c
+// Run: ./server [-t threads] [port]
+// Default port: 8080, one worker thread per online CPU
+//
+// Each worker thread has its own SO_REUSEPORT listener and edge-triggered
+// epoll loop, so workers share nothing and the kernel spreads connections
+// across them. Connections are kept open for any number of requests, and
+// requests may be pipelined: every complete line read from the socket is
+// answered, and all answers to one read go out in a single send().
+//
+// The response is always the same, so a connection's pending output is just
+// a byte count into a buffer holding the response many times over; nothing
+// is copied or allocated per request. A client that stops reading stops
+// being read once OUT_LIMIT bytes of answers are owed to it.
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 65536
+#define BACKLOG 4096
+#define MAX_EVENTS 256
+#define MAX_THREADS 256
+#define OUT_LIMIT (256 * 1024)
+#define RESPONSE "Hello from server\n"
+#define RESPONSE_LEN (sizeof RESPONSE - 1)
+#define RESPONSE_REPEAT 4096
+
+// One client connection, indexed by fd in its worker's table.
+struct conn {
+    int open;
+    int partial;        // bytes of an unterminated request have been read
+    int blocked;        // reading paused until the owed answers drain
+    int closing;        // peer is done; close once everything is sent
+    size_t owed;        // response bytes not yet accepted by the socket
+    size_t phase;       // offset into RESPONSE of the next byte owed
+};
+
+struct worker {
+    int epfd;
+    int listener;
+    pthread_t thread;
+    struct conn *conns;
+    int nconns;
+};
+
+static int port = PORT;
+
+// RESPONSE back to back; any run of owed bytes is a slice of this.
+static char responses[RESPONSE_REPEAT * RESPONSE_LEN];
 
-int main() {
-    int server_fd, new_socket;
+int setup_listen(void) {
+    int server_fd;
+    int yes = 1;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
 
-    // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         perror("socket failed");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    // every worker binds its own listener on the same port
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) < 0) {
+        perror("SO_REUSEPORT");
+        close(server_fd);
+        return -1;
     }
 
+    memset(&address, 0, sizeof address);
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(port);
 
-    // Bind the socket to the specified port
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind failed");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
     }
-
-    while(1)
-    {
-    // Listen for incoming connections
-    if (listen(server_fd, 3) < 0) {
+    // listen once; the backlog must absorb bursts of new connections
+    if (listen(server_fd, BACKLOG) < 0) {
         perror("listen");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
     }
+    return server_fd;
+}
 
-    // Accept a client connection
-    if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-        perror("accept");
-        exit(EXIT_FAILURE);
+void close_conn(struct worker *w, int fd) {
+    memset(&w->conns[fd], 0, sizeof w->conns[fd]);
+    close(fd);
+}
+
+// Send as much of what the connection is owed as the socket takes.
+// Returns -1 if the connection had to be closed.
+int flush_conn(struct worker *w, int fd) {
+    struct conn *c = &w->conns[fd];
+    while (c->owed > 0) {
+        size_t len = sizeof responses - c->phase;
+        if (len > c->owed) len = c->owed;
+        ssize_t n = send(fd, responses + c->phase, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            close_conn(w, fd);
+            return -1;
+        }
+        c->owed -= n;
+        c->phase = (c->phase + n) % RESPONSE_LEN;
+    }
+    if (c->closing) {
+        close_conn(w, fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Read every request available, then answer them all in one go.
+void read_conn(struct worker *w, int fd) {
+    struct conn *c = &w->conns[fd];
+    char buffer[BUFFER_SIZE];
+
+    c->blocked = 0;
+    while (1) {
+        if (c->owed >= OUT_LIMIT) {
+            // edge-triggered: EPOLLOUT will bring us back here once drained
+            c->blocked = 1;
+            break;
+        }
+        ssize_t n = recv(fd, buffer, sizeof buffer, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            close_conn(w, fd);
+            return;
+        }
+        if (n == 0) {
+            // an unterminated last request still gets its answer
+            if (c->partial) c->owed += RESPONSE_LEN;
+            c->closing = 1;
+            break;
+        }
+        const char *p = buffer;
+        const char *end = buffer + n;
+        const char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            c->owed += RESPONSE_LEN;
+            p = nl + 1;
+        }
+        if (p < end) c->partial = 1;
+        else if (p > buffer) c->partial = 0;
+    }
+    flush_conn(w, fd);
+}
+
+int grow_conns(struct worker *w, int fd) {
+    if (fd < w->nconns) return 0;
+    int n = w->nconns ? w->nconns : 1024;
+    while (n <= fd) n *= 2;
+    struct conn *grown = realloc(w->conns, n * sizeof *grown);
+    if (grown == NULL) return -1;
+    memset(grown + w->nconns, 0, (n - w->nconns) * sizeof *grown);
+    w->conns = grown;
+    w->nconns = n;
+    return 0;
+}
+
+void accept_conns(struct worker *w) {
+    // edge-triggered: drain the accept queue until it would block
+    while (1) {
+        int fd = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if (grow_conns(w, fd) == -1) {
+            close(fd);
+            continue;
+        }
+        // answers are small and must not wait for delayed ACKs
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            continue;
+        }
+        w->conns[fd].open = 1;
     }
+}
 
-    // Read data from the client
-    read(new_socket, buffer, BUFFER_SIZE);
-    printf("Server received: %s\n", buffer);
+void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
 
-    // Send a response to the client
-    const char *message = "Hello from server";
-    send(new_socket, message, strlen(message), 0);
-    printf("Server sent: %s\n", message);
+    while (1) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == w->listener) {
+                accept_conns(w);
+                continue;
+            }
+            struct conn *c = &w->conns[fd];
+            if (!c->open) continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_conn(w, fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (flush_conn(w, fd) == -1) continue;
+                if (c->blocked && c->owed < OUT_LIMIT) read_conn(w, fd);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP) && !c->blocked && !c->closing) read_conn(w, fd);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:h")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) port = atoi(argv[optind]);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+    // allow more connections than the usual 1024 descriptors
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (size_t i = 0; i < RESPONSE_REPEAT; ++i) memcpy(responses + i * RESPONSE_LEN, RESPONSE, RESPONSE_LEN);
+
+    struct worker *workers = calloc(nthreads, sizeof *workers);
+    if (workers == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        struct worker *w = &workers[i];
+        if ((w->listener = setup_listen()) < 0) exit(EXIT_FAILURE);
+        if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = w->listener };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listener, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Listening on port %d with %d worker%s\n", port, nthreads, nthreads == 1 ? "" : "s");
+    fflush(stdout);
 
+    for (int i = 1; i < nthreads; ++i) {
+        int rc = pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
     }
-    close(new_socket);
-    close(server_fd);
+    worker_loop(&workers[0]);
     return 0;
 }
@@ -1,13 +1,360 @@
+// unigib-mkdir.c
+// UniGib Make your own directory with a system call, in bulk
+// Compile: gcc -Wall -O2 -pthread -o unigib-mkdir unigib-mkdir.c
+// Run: ./unigib-mkdir                    (asks for one directory name)
+//      ./unigib-mkdir [-t threads] [-m mode] [-f manifest|-] [-g DEPTHxWIDTH] [root]
+//      ./unigib-mkdir -B [-n count] [-T threads,...] [-g DEPTHxWIDTH] [-k dir,file] [-s shared,private] [-c|-j]
+//                     [root]
+//
+// With no arguments it prompts for a single directory, as it always has.
+// Otherwise it creates whole trees, parents first as with mkdir -p:
+//   -f  one path per line from a manifest file, or stdin for "-"; blank
+//       lines and lines starting with # are skipped. Relative paths are
+//       taken under root (default ".").
+//   -g  a generated fan-out under root: WIDTH directories named 0..WIDTH-1
+//       at each of DEPTH levels, WIDTH + WIDTH^2 + ... + WIDTH^DEPTH in all.
+// The paths are merged into one tree in memory first, so shared parents
+// are created once. Creation then walks that tree with a pool of threads
+// (-t, default one per CPU): each directory is made with mkdirat()
+// relative to an open O_PATH fd of its parent, so the kernel never walks
+// the full path again. A parent's fd is opened only when its children's
+// turn comes and closed once they are all done, so few are open at once.
+// Entries that already exist cost one EEXIST and a stat, to fail on
+// non-directories as mkdir -p does, and are counted, not reported. A
+// failed entry counts its subtree as failed too. The summary gives
+// created, existing and failed counts and dirs/sec. -m sets the mode
+// (default 0755, less the umask).
+//
+// -B benchmarks filesystem metadata operations instead, to compare
+// filesystems and mount options. Each thread creates -n entries (default
+// 10000; directories, empty files or both with -k), stats them, renames
+// them within their directory and removes them, each as one timed phase
+// started together on a barrier. The entries go into one parent shared by
+// all threads, or a parent per thread (-s, both by default), spread over
+// the leaves of a DEPTHxWIDTH tree under it with -g (flat by default).
+// Every combination runs at each thread count of -T (default 1, 2, 4 ...
+// up to the CPU count), in a scratch directory under root that is removed
+// afterwards, even on SIGINT. The report gives ops/sec and the latency
+// distribution (hdr-hist.h) per operation as a table, CSV (-c) or JSON (-j).
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include "hdr-hist.h"
 
 #define MAX_DIRNAME_LEN 256
+#define MAX_THREADS 256
+#define TASK_CHILDREN 256       // children handed out per task
+#define MAX_ERRORS 10           // failures reported individually
+
+// One directory of the tree to create.
+struct node {
+    struct node *parent;
+    struct node **children;
+    uint32_t nchildren, cap;
+    int fd;                     // O_PATH fd while its children are being made
+    int refs;                   // queued or running tasks that need fd
+    char name[];
+};
+
+// Lookup of (parent, name) -> node while building the tree.
+struct node **table;
+size_t table_slots, table_used;
+
+// Work: make dir's children [begin, end), or with open set, open dir's fd
+// and queue its children. Opening only when the task is popped keeps the
+// fds open at once down to roughly the tree depth per worker, rather than
+// one for every directory that has been made but not yet filled.
+struct task {
+    struct node *dir;
+    uint32_t begin, end;
+    int open;
+};
+
+struct task *tasks;
+size_t ntasks, task_cap;
+int busy;                       // workers holding a task
+pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_ready = PTHREAD_COND_INITIALIZER;
+
+struct worker {
+    pthread_t thread;
+    size_t created, existed, failed;
+};
+
+mode_t dir_mode = 0755;
+int errors_reported;
+
+// Lift the soft open-file limit to the hard one.
+void raise_nofile(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+size_t hash_entry(const struct node *parent, const char *name, size_t len) {
+    uint64_t h = (uintptr_t)parent;
+    for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+struct node *new_node(struct node *parent, const char *name, size_t len) {
+    struct node *n = calloc(1, sizeof *n + len + 1);
+    if (n == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(n->name, name, len);
+    n->parent = parent;
+    n->fd = -1;
+    if (parent != NULL) {
+        if (parent->nchildren == parent->cap) {
+            parent->cap = parent->cap ? parent->cap * 2 : 4;
+            parent->children = xrealloc(parent->children, parent->cap * sizeof *parent->children);
+        }
+        parent->children[parent->nchildren++] = n;
+    }
+    return n;
+}
+
+void grow_table(void) {
+    struct node **old = table;
+    size_t old_slots = table_slots;
+
+    table_slots = table_slots ? table_slots * 2 : 1024;
+    table = calloc(table_slots, sizeof *table);
+    if (table == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_slots; ++i) {
+        if (old[i] == NULL) continue;
+        size_t j = hash_entry(old[i]->parent, old[i]->name, strlen(old[i]->name)) & (table_slots - 1);
+        while (table[j] != NULL) j = (j + 1) & (table_slots - 1);
+        table[j] = old[i];
+    }
+    free(old);
+}
+
+// The child of parent called name, added if it is not there yet.
+struct node *child(struct node *parent, const char *name, size_t len) {
+    if (2 * (table_used + 1) > table_slots) grow_table();
+    size_t mask = table_slots - 1, i = hash_entry(parent, name, len) & mask;
+    for (; table[i] != NULL; i = (i + 1) & mask) {
+        struct node *n = table[i];
+        if (n->parent == parent && strncmp(n->name, name, len) == 0 && n->name[len] == '\0') return n;
+    }
+    table_used++;
+    return table[i] = new_node(parent, name, len);
+}
+
+// Add every component of path under base (or the filesystem root for an
+// absolute path) and return the last one.
+struct node *add_path(struct node *base, struct node *slash, const char *path) {
+    struct node *n = path[0] == '/' ? slash : base;
+    while (*path) {
+        size_t len = strcspn(path, "/");
+        if (len > 0 && !(len == 1 && path[0] == '.')) n = child(n, path, len);
+        path += len;
+        while (*path == '/') path++;
+    }
+    return n;
+}
+
+// Give n a WIDTH-wide fan-out, depth levels deep.
+void add_fanout(struct node *n, int depth, int width) {
+    char name[16];
+    if (depth == 0) return;
+    for (int i = 0; i < width; ++i) {
+        int len = snprintf(name, sizeof name, "%d", i);
+        add_fanout(new_node(n, name, len), depth - 1, width);
+    }
+}
 
-int main() {
+size_t subtree_size(const struct node *n) {
+    size_t total = 1;
+    for (uint32_t i = 0; i < n->nchildren; ++i) total += subtree_size(n->children[i]);
+    return total;
+}
+
+void free_tree(struct node *n) {
+    for (uint32_t i = 0; i < n->nchildren; ++i) free_tree(n->children[i]);
+    free(n->children);
+    free(n);
+}
+
+void node_path(const struct node *n, char *buf, size_t len) {
+    if (n->parent == NULL) {
+        snprintf(buf, len, "%s", n->name);
+        return;
+    }
+    node_path(n->parent, buf, len);
+    size_t used = strlen(buf);
+    snprintf(buf + used, len - used, "%s%s", used && buf[used - 1] != '/' ? "/" : "", n->name);
+}
+
+void report_error(const struct node *n, const char *what, int err) {
+    char path[4096];
+    pthread_mutex_lock(&task_lock);
+    if (errors_reported++ < MAX_ERRORS) {
+        node_path(n, path, sizeof path);
+        fprintf(stderr, "%s %s: %s\n", what, path, strerror(err));
+    }
+    pthread_mutex_unlock(&task_lock);
+}
+
+// Called with task_lock held.
+void push_task(struct node *dir, uint32_t begin, uint32_t end, int open) {
+    if (ntasks == task_cap) {
+        task_cap = task_cap ? task_cap * 2 : 256;
+        tasks = xrealloc(tasks, task_cap * sizeof *tasks);
+    }
+    tasks[ntasks].dir = dir;
+    tasks[ntasks].begin = begin;
+    tasks[ntasks].end = end;
+    tasks[ntasks].open = open;
+    ntasks++;
+    pthread_cond_broadcast(&task_ready);
+}
+
+// Queue n's children in TASK_CHILDREN pieces; n->fd must be open. Called
+// with task_lock held.
+void push_children(struct node *n) {
+    uint32_t pieces = (n->nchildren + TASK_CHILDREN - 1) / TASK_CHILDREN;
+    __atomic_add_fetch(&n->refs, pieces, __ATOMIC_ACQ_REL);
+    for (uint32_t p = 0; p < pieces; ++p) {
+        push_task(n, p * TASK_CHILDREN, p + 1 < pieces ? (p + 1) * TASK_CHILDREN : n->nchildren, 0);
+    }
+}
+
+// Drop one task's hold on n's fd, closing it after the last.
+void release(struct node *n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(n->fd);
+        n->fd = -1;
+    }
+}
+
+void run_task(struct worker *w, const struct task *t) {
+    struct node *dir = t->dir;
+    if (t->open) {
+        // the parent's fd is held open for us until release() below
+        dir->fd = openat(dir->parent->fd, dir->name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd < 0) {
+            report_error(dir, "open", errno);
+            w->failed += subtree_size(dir) - 1;
+        } else {
+            pthread_mutex_lock(&task_lock);
+            push_children(dir);
+            pthread_mutex_unlock(&task_lock);
+        }
+        release(dir->parent);
+        return;
+    }
+    for (uint32_t i = t->begin; i < t->end; ++i) {
+        struct node *c = dir->children[i];
+        if (mkdirat(dir->fd, c->name, dir_mode) == 0) {
+            w->created++;
+        } else if (errno == EEXIST) {
+            // it has to be a directory (or a link to one), as for mkdir -p
+            struct stat st;
+            int err = 0;
+            if (fstatat(dir->fd, c->name, &st, 0) != 0) err = errno;
+            else if (!S_ISDIR(st.st_mode)) err = ENOTDIR;
+            if (err) {
+                report_error(c, "mkdir", err);
+                w->failed += subtree_size(c);
+                continue;
+            }
+            w->existed++;
+        } else {
+            report_error(c, "mkdir", errno);
+            w->failed += subtree_size(c);
+            continue;
+        }
+        if (c->nchildren == 0) continue;
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&task_lock);
+        push_task(c, 0, 0, 1);
+        pthread_mutex_unlock(&task_lock);
+    }
+    release(dir);
+}
+
+void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    pthread_mutex_lock(&task_lock);
+    for (;;) {
+        while (ntasks == 0 && busy > 0) pthread_cond_wait(&task_ready, &task_lock);
+        if (ntasks == 0) break;     // nothing queued and nobody left to queue more
+        struct task t = tasks[--ntasks];
+        busy++;
+        pthread_mutex_unlock(&task_lock);
+        run_task(w, &t);
+        pthread_mutex_lock(&task_lock);
+        if (--busy == 0 && ntasks == 0) pthread_cond_broadcast(&task_ready);
+    }
+    pthread_mutex_unlock(&task_lock);
+    return NULL;
+}
+
+int read_manifest(const char *path, struct node *base, struct node *slash) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int count = 0;
+
+    if (in == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while ((len = getline(&line, &cap, in)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        add_path(base, slash, line);
+        count++;
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    return count;
+}
+
+// The original single-directory prompt.
+int interactive(void) {
     char dirname[MAX_DIRNAME_LEN];
     int status;
 
@@ -39,7 +386,7 @@ int main() {
         // Error handling
         fprintf(stderr, "Unable to create directory '%s': ", dirname);
         perror(""); // perror() prints a descriptive error message based on errno
-        
+
         // Specific error messages
         if (errno == EEXIST) {
             fprintf(stderr, "Error: The directory or a file with that name already exists.\n");
@@ -52,3 +399,400 @@ int main() {
     return EXIT_SUCCESS;
 }
 
+// ---- Metadata benchmark (-B) ----
+
+enum { OP_CREATE, OP_STAT, OP_RENAME, OP_REMOVE, NUM_OPS };
+const char *op_names[NUM_OPS] = { "create", "stat", "rename", "remove" };
+
+enum { KIND_DIR, KIND_FILE, NUM_KINDS };
+const char *kind_names[NUM_KINDS] = { "dir", "file" };
+
+enum { SHARED, PRIVATE, NUM_SHARING };
+const char *sharing_names[NUM_SHARING] = { "shared", "private" };
+
+static int stop;                // set on SIGINT/SIGTERM
+
+void on_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+// One thread's part of a run: count entries spread over the leaf
+// directories in leaves, one timed pass per operation.
+struct bench_job {
+    pthread_t thread;
+    int id;
+    int kind;
+    long count;
+    const int *leaves;          // O_PATH fds, shared or this thread's own
+    int nleaves;
+    pthread_barrier_t *barrier;
+    double elapsed[NUM_OPS];
+    size_t errors[NUM_OPS];
+    struct hdr_hist hist[NUM_OPS];  // latency per op in ns
+};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int do_op(int op, int kind, int dirfd, const char *name, const char *renamed) {
+    struct stat st;
+    switch (op) {
+    case OP_CREATE:
+        if (kind == KIND_DIR) return mkdirat(dirfd, name, dir_mode);
+        int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        return fd < 0 ? -1 : close(fd);
+    case OP_STAT:
+        return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    case OP_RENAME:
+        return renameat(dirfd, name, dirfd, renamed);
+    default:
+        return unlinkat(dirfd, renamed, kind == KIND_DIR ? AT_REMOVEDIR : 0);
+    }
+}
+
+void *bench_worker(void *arg) {
+    struct bench_job *job = arg;
+    char name[64], renamed[64];
+
+    for (int op = 0; op < NUM_OPS; ++op) {
+        pthread_barrier_wait(job->barrier);
+        uint64_t t0 = now_ns();
+        for (long j = 0; j < job->count && !__atomic_load_n(&stop, __ATOMIC_RELAXED); ++j) {
+            // names carry the thread id, so shared parents never collide
+            snprintf(name, sizeof name, "t%d.%ld", job->id, j);
+            snprintf(renamed, sizeof renamed, "t%d.%ld.r", job->id, j);
+            int dirfd = job->leaves[j % job->nleaves];
+            uint64_t s = now_ns();
+            if (do_op(op, job->kind, dirfd, name, renamed) != 0) job->errors[op]++;
+            hdr_record(&job->hist[op], now_ns() - s);
+        }
+        job->elapsed[op] = (now_ns() - t0) / 1e9;
+    }
+    return NULL;
+}
+
+// Make a DEPTHxWIDTH tree of directories under dirfd and add O_PATH fds
+// of its leaves to fds; depth 0 makes dirfd itself the only leaf.
+int build_tree(int dirfd, int depth, int width, int *fds, int *nfds) {
+    if (depth == 0) {
+        if ((fds[(*nfds)++] = fcntl(dirfd, F_DUPFD_CLOEXEC, 0)) < 0) return -1;
+        return 0;
+    }
+    for (int i = 0; i < width; ++i) {
+        char name[16];
+        snprintf(name, sizeof name, "%d", i);
+        if (mkdirat(dirfd, name, 0755) != 0) return -1;
+        int fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        int r = build_tree(fd, depth - 1, width, fds, nfds);
+        close(fd);
+        if (r != 0) return -1;
+    }
+    return 0;
+}
+
+// rm -rf name under dirfd; does not follow symlinks.
+int remove_tree(int dirfd, const char *name) {
+    if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) return 0;
+    if (errno != EISDIR && errno != EPERM) return -1;
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) == 0) return 0;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) return -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) remove_tree(fd, ent->d_name);
+    }
+    closedir(dir);
+    return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+struct bench_config {
+    long count;                 // entries per thread
+    int depth, width;           // tree shape holding the entries
+    int format;
+    FILE *out;
+};
+
+enum format { FMT_TABLE, FMT_CSV, FMT_JSON };
+
+// One run: a scratch directory under rootfd holding a tree (shared) or a
+// tree per thread (private), all four operations, then cleanup.
+int bench_run(int rootfd, const struct bench_config *cfg, int kind, int sharing, int nthreads, const char **sep) {
+    int per_tree = 1;
+    for (int d = 0; d < cfg->depth; ++d) per_tree *= cfg->width;
+    int trees = sharing == SHARED ? 1 : nthreads;
+    int *fds = malloc((size_t)per_tree * trees * sizeof *fds), nfds = 0;
+    struct bench_job *jobs = calloc(nthreads, sizeof *jobs);
+    char scratch[64];
+    pthread_barrier_t barrier;
+
+    if (fds == NULL || jobs == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(scratch, sizeof scratch, "unigib-bench.%d", (int)getpid());
+    int scratchfd = -1;
+    if (mkdirat(rootfd, scratch, 0755) != 0
+        || (scratchfd = openat(rootfd, scratch, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror(scratch);
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < trees; ++t) {
+        char name[16];
+        snprintf(name, sizeof name, "p%d", t);
+        int fd = -1;
+        if (mkdirat(scratchfd, name, 0755) != 0 || (fd = openat(scratchfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0
+            || build_tree(fd, cfg->depth, cfg->width, fds, &nfds) != 0) {
+            perror("building the benchmark tree");
+            if (fd >= 0) close(fd);
+            for (int i = 0; i < nfds; ++i) close(fds[i]);
+            remove_tree(rootfd, scratch);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        jobs[i].id = i;
+        jobs[i].kind = kind;
+        jobs[i].count = cfg->count;
+        jobs[i].leaves = sharing == SHARED ? fds : fds + (size_t)i * per_tree;
+        jobs[i].nleaves = per_tree;
+        jobs[i].barrier = &barrier;
+        for (int op = 0; op < NUM_OPS; ++op) hdr_init(&jobs[i].hist[op]);
+        if (pthread_create(&jobs[i].thread, NULL, bench_worker, &jobs[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nthreads; ++i) pthread_join(jobs[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+    for (int i = 0; i < nfds; ++i) close(fds[i]);
+    close(scratchfd);
+    if (remove_tree(rootfd, scratch) != 0) perror(scratch);
+
+    struct hdr_hist *all = malloc(sizeof *all);
+    if (all == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int op = 0; op < NUM_OPS; ++op) {
+        double wall = 0;
+        size_t errors = 0;
+        hdr_init(all);
+        for (int i = 0; i < nthreads; ++i) {
+            hdr_merge(all, &jobs[i].hist[op]);
+            errors += jobs[i].errors[op];
+            if (jobs[i].elapsed[op] > wall) wall = jobs[i].elapsed[op];
+        }
+        double rate = wall > 0 ? all->count / wall : 0;
+        if (cfg->format == FMT_JSON) {
+            fprintf(cfg->out, "%s    {\"kind\": \"%s\", \"parent\": \"%s\", \"threads\": %d, \"op\": \"%s\", "
+                    "\"ops\": %llu, \"errors\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"latency_us\": ",
+                    *sep, kind_names[kind], sharing_names[sharing], nthreads, op_names[op],
+                    (unsigned long long)all->count, errors, wall, rate);
+            hdr_print_json(all, cfg->out, 1000.0);
+            fprintf(cfg->out, "}");
+            *sep = ",\n";
+        } else if (cfg->format == FMT_CSV) {
+            fprintf(cfg->out, "%s,%s,%d,%s,%llu,%zu,%.6f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n", kind_names[kind],
+                    sharing_names[sharing], nthreads, op_names[op], (unsigned long long)all->count, errors, wall, rate,
+                    hdr_mean(all) / 1e3, hdr_percentile(all, 50) / 1e3, hdr_percentile(all, 99) / 1e3,
+                    hdr_percentile(all, 99.9) / 1e3, all->max / 1e3);
+        } else {
+            fprintf(cfg->out, "%-4s %-7s %7d %-6s %9llu %6zu %12.0f %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+                    kind_names[kind], sharing_names[sharing], nthreads, op_names[op], (unsigned long long)all->count,
+                    errors, rate, hdr_mean(all) / 1e3, hdr_percentile(all, 50) / 1e3, hdr_percentile(all, 99) / 1e3,
+                    hdr_percentile(all, 99.9) / 1e3, all->max / 1e3);
+        }
+        fflush(cfg->out);
+    }
+    free(all);
+    free(jobs);
+    free(fds);
+    return 0;
+}
+
+// Every kind x parent sharing x thread count, in a scratch directory
+// under root that is removed again after each run.
+int run_benchmarks(const char *root, const struct bench_config *cfg, unsigned kinds, unsigned sharings,
+                   const int *threads, int nthreads) {
+    const char *sep = "";
+    int rootfd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0) {
+        perror(root);
+        exit(EXIT_FAILURE);
+    }
+    // private trees and wide shapes hold many leaf fds open at once
+    raise_nofile();
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (cfg->depth > 0) {
+        fprintf(stderr, "Metadata benchmark in %s: %ld entries per thread over the leaves of a %dx%d tree per parent\n",
+                root, cfg->count, cfg->depth, cfg->width);
+    } else {
+        fprintf(stderr, "Metadata benchmark in %s: %ld entries per thread, flat in each parent\n", root, cfg->count);
+    }
+    if (cfg->format == FMT_JSON) {
+        fprintf(cfg->out, "{\"root\": \"%s\", \"count\": %ld, \"depth\": %d, \"width\": %d, \"results\": [\n", root,
+                cfg->count, cfg->depth, cfg->width);
+    } else if (cfg->format == FMT_CSV) {
+        fprintf(cfg->out, "kind,parent,threads,op,ops,errors,seconds,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    } else {
+        fprintf(cfg->out, "%-4s %-7s %7s %-6s %9s %6s %12s %9s %9s %9s %9s %10s\n", "kind", "parent", "threads", "op",
+                "ops", "errors", "ops/sec", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    }
+    for (int k = 0; k < NUM_KINDS; ++k) {
+        for (int s = 0; s < NUM_SHARING; ++s) {
+            for (int t = 0; t < nthreads && !__atomic_load_n(&stop, __ATOMIC_RELAXED); ++t) {
+                if ((kinds & (1u << k)) && (sharings & (1u << s))) bench_run(rootfd, cfg, k, s, threads[t], &sep);
+            }
+        }
+    }
+    if (cfg->format == FMT_JSON) fprintf(cfg->out, "\n  ]}\n");
+    close(rootfd);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s\n"
+                    "       %s [-t threads] [-m mode] [-f manifest|-] [-g DEPTHxWIDTH] [root]\n"
+                    "       %s -B [-n count] [-T threads,...] [-g DEPTHxWIDTH] [-k dir,file] [-s shared,private] [-c|-j]\n"
+                    "          [root]\n", prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *manifest = NULL;
+    int depth = 0, width = 0, nthreads = 0;
+    int benchmark = 0, threads[MAX_THREADS], nbench = 0;
+    unsigned kinds = (1u << NUM_KINDS) - 1, sharings = (1u << NUM_SHARING) - 1;
+    struct bench_config cfg = { 10000, 0, 1, FMT_TABLE, stdout };
+    int opt;
+
+    if (argc == 1) return interactive();
+
+    while ((opt = getopt(argc, argv, "t:m:f:g:Bn:T:k:s:cjh")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'm': dir_mode = (mode_t)strtol(optarg, NULL, 8); break;
+        case 'f': manifest = optarg; break;
+        case 'g':
+            if (sscanf(optarg, "%dx%d", &depth, &width) != 2 || depth < 1 || width < 1) usage(argv[0]);
+            break;
+        case 'B': benchmark = 1; break;
+        case 'n': cfg.count = atol(optarg); break;
+        case 'T':
+            for (char *tok = strtok(optarg, ","); tok != NULL && nbench < MAX_THREADS; tok = strtok(NULL, ",")) {
+                threads[nbench] = atoi(tok);
+                if (threads[nbench] < 1 || threads[nbench] > MAX_THREADS) usage(argv[0]);
+                nbench++;
+            }
+            break;
+        case 'k':
+            kinds = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int k;
+                for (k = 0; k < NUM_KINDS && strcmp(tok, kind_names[k]) != 0; ++k);
+                if (k == NUM_KINDS) usage(argv[0]);
+                kinds |= 1u << k;
+            }
+            break;
+        case 's':
+            sharings = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int k;
+                for (k = 0; k < NUM_SHARING && strcmp(tok, sharing_names[k]) != 0; ++k);
+                if (k == NUM_SHARING) usage(argv[0]);
+                sharings |= 1u << k;
+            }
+            break;
+        case 'c': cfg.format = FMT_CSV; break;
+        case 'j': cfg.format = FMT_JSON; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (benchmark) {
+        if (optind + 1 < argc || cfg.count < 1) usage(argv[0]);
+        cfg.depth = depth;
+        cfg.width = width ? width : 1;
+        if (nbench == 0) {
+            cpu_set_t set;
+            int cpus = sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : 1;
+            if (cpus > MAX_THREADS) cpus = MAX_THREADS;
+            for (int t = 1; t < cpus; t *= 2) threads[nbench++] = t;
+            threads[nbench++] = cpus;
+        }
+        return run_benchmarks(optind < argc ? argv[optind] : ".", &cfg, kinds, sharings, threads, nbench);
+    }
+    if (optind + 1 < argc || nthreads < 0 || nthreads > MAX_THREADS) usage(argv[0]);
+    const char *root = optind < argc ? argv[optind] : ".";
+    if (manifest == NULL && depth == 0 && optind == argc) usage(argv[0]);
+    if (nthreads == 0) {
+        cpu_set_t set;
+        nthreads = sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : 1;
+        if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    }
+
+    // "." and "/" are the two roots every path hangs from
+    struct node *dot = new_node(NULL, ".", 1), *slash = new_node(NULL, "/", 1);
+    double t0 = now_sec();
+    struct node *base = add_path(dot, slash, root);
+    int lines = manifest != NULL ? read_manifest(manifest, base, slash) : 0;
+    if (depth > 0) add_fanout(base, depth, width);
+    size_t total = subtree_size(dot) + subtree_size(slash) - 2;
+    double t1 = now_sec();
+    fprintf(stderr, "Planned %zu directories (%d manifest lines) in %.3f s; creating with %d threads\n", total, lines,
+            t1 - t0, nthreads);
+    free(table);
+    table = NULL;
+
+    // each worker holds about one fd per tree level; deep trees need more
+    raise_nofile();
+    struct node *tops[] = { dot, slash };
+    for (int i = 0; i < 2; ++i) {
+        if (tops[i]->nchildren == 0) continue;
+        tops[i]->fd = open(tops[i]->name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (tops[i]->fd < 0) {
+            perror(tops[i]->name);
+            exit(EXIT_FAILURE);
+        }
+        push_children(tops[i]);
+    }
+
+    struct worker *workers = calloc(nthreads, sizeof *workers);
+    if (workers == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t created = 0, existed = 0, failed = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        created += workers[i].created;
+        existed += workers[i].existed;
+        failed += workers[i].failed;
+    }
+    double elapsed = now_sec() - t1;
+
+    if (errors_reported > MAX_ERRORS) fprintf(stderr, "... %d more errors\n", errors_reported - MAX_ERRORS);
+    printf("Created %zu directories, %zu already existed, %zu failed in %.3f s: %.0f dirs/sec with %d threads\n",
+           created, existed, failed, elapsed, elapsed > 0 ? (created + existed) / elapsed : 0.0, nthreads);
+    free(workers);
+    free(tasks);
+    free_tree(dot);
+    free_tree(slash);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}